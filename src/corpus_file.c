@@ -0,0 +1,673 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "rcorpus.h"
+
+#ifdef RCORPUS_ALTREP
+#include <R_ext/Altrep.h>
+#endif
+
+/*
+ * A corpus file stores texts that are already validated and unescaped,
+ * so that reading them back takes no parsing. In native byte order:
+ *
+ *     header: char magic[8], int64 nrow, int64 meta_size, int64 data_size
+ *     meta:   uint8 meta[meta_size]
+ *     data:   uint8 data[data_size]
+ *     attr:   uint64 attr[nrow]
+ *     offset: uint64 offset[nrow]
+ *
+ * The meta and data sections get zero-padded to multiples of 8 bytes.
+ * Each 'attr' is the utf8lite text attribute, or CORPUS_FILE_NA for a
+ * missing text; since the texts are unescaped, its escape bit is clear,
+ * but it keeps the UTF-8 bit for a non-ASCII text. Each 'offset' is the
+ * start of the text in 'data'. The meta section holds the names, the
+ * other data frame columns, and the text filter, serialized by R. The
+ * row arrays come last, so that the texts can get written in one pass.
+ */
+
+#define CORPUS_FILE_MAGIC "corpusCF"
+#define CORPUS_FILE_HEADER_SIZE (8 + 3 * sizeof(int64_t))
+#define CORPUS_FILE_NA UINT64_MAX
+
+#define PAD8(x) (((x) + 7) & ~(int64_t)7)
+
+
+int corpus_file_init(struct corpus_file *file,
+		     const struct corpus_filebuf *buf)
+{
+	const uint8_t *ptr = buf->map_addr;
+	uint64_t size = (uint64_t)buf->map_size;
+	uint64_t rest;
+
+	if (size < CORPUS_FILE_HEADER_SIZE
+			|| memcmp(ptr, CORPUS_FILE_MAGIC, 8) != 0) {
+		return CORPUS_ERROR_INVAL;
+	}
+	ptr += 8;
+
+	memcpy(&file->nrow, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&file->meta_size, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&file->data_size, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+
+	if (file->nrow < 0 || file->meta_size < 0 || file->data_size < 0) {
+		return CORPUS_ERROR_INVAL;
+	}
+
+	// check the section sizes against the file size, without overflow
+	rest = size - CORPUS_FILE_HEADER_SIZE;
+	if ((uint64_t)PAD8(file->meta_size) > rest) {
+		return CORPUS_ERROR_INVAL;
+	}
+	rest -= (uint64_t)PAD8(file->meta_size);
+	if ((uint64_t)PAD8(file->data_size) > rest) {
+		return CORPUS_ERROR_INVAL;
+	}
+	rest -= (uint64_t)PAD8(file->data_size);
+	if ((uint64_t)file->nrow > rest / (2 * sizeof(uint64_t))) {
+		return CORPUS_ERROR_INVAL;
+	}
+
+	file->buf = buf;
+	file->meta = ptr;
+	ptr += PAD8(file->meta_size);
+	file->data = ptr;
+	ptr += PAD8(file->data_size);
+	file->attr = ptr;
+	ptr += file->nrow * sizeof(uint64_t);
+	file->offset = ptr;
+
+	return 0;
+}
+
+
+int corpus_file_text(const struct corpus_file *file, int64_t i,
+		     struct utf8lite_text *text)
+{
+	uint64_t attr, offset, size;
+
+	memcpy(&attr, file->attr + i * sizeof(uint64_t), sizeof(attr));
+	memcpy(&offset, file->offset + i * sizeof(uint64_t), sizeof(offset));
+
+	if (attr == CORPUS_FILE_NA) {
+		text->ptr = NULL;
+		text->attr = 0;
+		return 0;
+	}
+
+	// the only flag a stored text can have is the UTF-8 bit
+	size = attr & (uint64_t)UTF8LITE_TEXT_SIZE_MASK;
+	if ((attr & ~(uint64_t)(UTF8LITE_TEXT_SIZE_MASK
+				| UTF8LITE_TEXT_UTF8_BIT))
+			|| attr > (uint64_t)SIZE_MAX
+			|| offset > (uint64_t)file->data_size
+			|| size > (uint64_t)file->data_size - offset) {
+		return CORPUS_ERROR_INVAL;
+	}
+
+	text->ptr = (uint8_t *)file->data + offset;
+	text->attr = (size_t)attr;
+	return 0;
+}
+
+
+static struct corpus_file *as_corpus_file(SEXP sbuf, struct corpus_file *file)
+{
+	const struct corpus_filebuf *buf = as_filebuf(sbuf);
+
+	if (corpus_file_init(file, buf)) {
+		error("file '%s' is not a valid corpus file", buf->file_name);
+	}
+	return file;
+}
+
+
+SEXP corpus_file_meta(SEXP sfile)
+{
+	SEXP ans, sbuf;
+	struct corpus_file file;
+
+	PROTECT(sbuf = alloc_filebuf(sfile));
+	as_corpus_file(sbuf, &file);
+
+	PROTECT(ans = allocVector(RAWSXP, (R_xlen_t)file.meta_size));
+	memcpy(RAW(ans), file.meta, (size_t)file.meta_size);
+	UNPROTECT(2);
+	return ans;
+}
+
+
+/* The columns of the table for a text read from a corpus file */
+enum file_column {
+	FILE_SOURCE = 0,
+	FILE_ROW,
+	FILE_START,
+	FILE_STOP,
+	FILE_NCOLUMN
+};
+
+
+static int file_column_int(const struct corpus_file *file,
+			   enum file_column column, R_xlen_t i)
+{
+	struct utf8lite_text text;
+	size_t size;
+
+	if (column == FILE_SOURCE) {
+		return 1;
+	}
+
+	if (corpus_file_text(file, i, &text)) {
+		error("file '%s' is not a valid corpus file",
+		      file->buf->file_name);
+	}
+
+	if (!text.ptr) {
+		return NA_INTEGER;
+	} else if (column == FILE_START) {
+		return 1;
+	}
+
+	size = UTF8LITE_TEXT_SIZE(&text);
+	if (size > INT_MAX) {
+		error("text size in row %"PRIu64" (%"PRIu64" bytes)"
+		      " exceeds maximum (%d bytes)", (uint64_t)i + 1,
+		      (uint64_t)size, INT_MAX);
+	}
+	return (int)size;
+}
+
+
+/* Allocate a column of the table for a text whose source is the file */
+static SEXP file_column_alloc(SEXP sbuf, enum file_column column)
+{
+	SEXP ans;
+	struct corpus_file file;
+	R_xlen_t i, n;
+
+	as_corpus_file(sbuf, &file);
+	n = (R_xlen_t)file.nrow;
+
+	if (column == FILE_ROW) {
+		PROTECT(ans = allocVector(REALSXP, n));
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			REAL(ans)[i] = (double)i + 1;
+		}
+	} else {
+		PROTECT(ans = allocVector(INTSXP, n));
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			INTEGER(ans)[i] = file_column_int(&file, column, i);
+		}
+	}
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+#ifdef RCORPUS_ALTREP
+
+/*
+ * Compact table columns for a text read from a corpus file. The first
+ * data slot holds the file buffer, and the elements get computed from the
+ * row attributes stored in the file. The second slot is R_NilValue until
+ * R asks for a pointer to the data, at which point it holds the ordinary
+ * column. Subsetting the table makes ordinary columns.
+ */
+
+static R_altrep_class_t file_column_class[FILE_NCOLUMN];
+
+
+static SEXP file_column(SEXP sbuf, enum file_column column)
+{
+	return R_new_altrep(file_column_class[column], sbuf, R_NilValue);
+}
+
+
+static SEXP file_column_data(SEXP x, enum file_column column)
+{
+	SEXP data = R_altrep_data2(x);
+
+	if (data == R_NilValue) {
+		PROTECT(data = file_column_alloc(R_altrep_data1(x), column));
+		R_set_altrep_data2(x, data);
+		UNPROTECT(1);
+	}
+	return data;
+}
+
+
+static R_xlen_t file_column_length(SEXP x)
+{
+	struct corpus_file file;
+
+	as_corpus_file(R_altrep_data1(x), &file);
+	return (R_xlen_t)file.nrow;
+}
+
+
+static int file_column_elt(SEXP x, R_xlen_t i, enum file_column column)
+{
+	SEXP data = R_altrep_data2(x);
+	struct corpus_file file;
+
+	if (data != R_NilValue) {
+		return INTEGER_ELT(data, i);
+	}
+
+	as_corpus_file(R_altrep_data1(x), &file);
+	return file_column_int(&file, column, i);
+}
+
+
+static const void *file_column_dataptr_or_null(SEXP x)
+{
+	SEXP data = R_altrep_data2(x);
+
+	if (data == R_NilValue) {
+		return NULL;
+	} else if (TYPEOF(data) == REALSXP) {
+		return REAL_RO(data);
+	}
+	return INTEGER_RO(data);
+}
+
+
+static void *file_source_dataptr(SEXP x, Rboolean writeable)
+{
+	(void)writeable;
+	return INTEGER(file_column_data(x, FILE_SOURCE));
+}
+
+
+static void *file_row_dataptr(SEXP x, Rboolean writeable)
+{
+	(void)writeable;
+	return REAL(file_column_data(x, FILE_ROW));
+}
+
+
+static void *file_start_dataptr(SEXP x, Rboolean writeable)
+{
+	(void)writeable;
+	return INTEGER(file_column_data(x, FILE_START));
+}
+
+
+static void *file_stop_dataptr(SEXP x, Rboolean writeable)
+{
+	(void)writeable;
+	return INTEGER(file_column_data(x, FILE_STOP));
+}
+
+
+static int file_source_elt(SEXP x, R_xlen_t i)
+{
+	return file_column_elt(x, i, FILE_SOURCE);
+}
+
+
+static double file_row_elt(SEXP x, R_xlen_t i)
+{
+	SEXP data = R_altrep_data2(x);
+
+	if (data != R_NilValue) {
+		return REAL_ELT(data, i);
+	}
+	return (double)i + 1;
+}
+
+
+static int file_start_elt(SEXP x, R_xlen_t i)
+{
+	return file_column_elt(x, i, FILE_START);
+}
+
+
+static int file_stop_elt(SEXP x, R_xlen_t i)
+{
+	return file_column_elt(x, i, FILE_STOP);
+}
+
+
+static R_altrep_class_t file_column_make(const char *name,
+					 enum file_column column,
+					 DllInfo *dll)
+{
+	R_altrep_class_t cls;
+
+	if (column == FILE_ROW) {
+		cls = R_make_altreal_class(name, "corpus", dll);
+		R_set_altvec_Dataptr_method(cls, file_row_dataptr);
+		R_set_altreal_Elt_method(cls, file_row_elt);
+	} else {
+		cls = R_make_altinteger_class(name, "corpus", dll);
+		switch (column) {
+		case FILE_SOURCE:
+			R_set_altvec_Dataptr_method(cls, file_source_dataptr);
+			R_set_altinteger_Elt_method(cls, file_source_elt);
+			break;
+		case FILE_START:
+			R_set_altvec_Dataptr_method(cls, file_start_dataptr);
+			R_set_altinteger_Elt_method(cls, file_start_elt);
+			break;
+		default:
+			R_set_altvec_Dataptr_method(cls, file_stop_dataptr);
+			R_set_altinteger_Elt_method(cls, file_stop_elt);
+			break;
+		}
+	}
+
+	R_set_altrep_Length_method(cls, file_column_length);
+	R_set_altvec_Dataptr_or_null_method(cls, file_column_dataptr_or_null);
+	return cls;
+}
+
+
+void init_corpus_file_altrep(DllInfo *dll)
+{
+	file_column_class[FILE_SOURCE] =
+		file_column_make("corpus_file_source", FILE_SOURCE, dll);
+	file_column_class[FILE_ROW] =
+		file_column_make("corpus_file_row", FILE_ROW, dll);
+	file_column_class[FILE_START] =
+		file_column_make("corpus_file_start", FILE_START, dll);
+	file_column_class[FILE_STOP] =
+		file_column_make("corpus_file_stop", FILE_STOP, dll);
+}
+
+
+/*
+ * Test whether a text table is the untouched table for all of the rows
+ * of a corpus file, so that the texts can get read straight from it.
+ */
+int is_corpus_file_table(SEXP table, SEXP sbuf)
+{
+	static const char *names[FILE_NCOLUMN] = {
+		"source", "row", "start", "stop"
+	};
+	SEXP col;
+	int j;
+
+	for (j = 0; j < FILE_NCOLUMN; j++) {
+		col = getListElement(table, names[j]);
+		if (!ALTREP(col) || R_altrep_data1(col) != sbuf) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#else
+
+static SEXP file_column(SEXP sbuf, enum file_column column)
+{
+	return file_column_alloc(sbuf, column);
+}
+
+
+int is_corpus_file_table(SEXP table, SEXP sbuf)
+{
+	(void)table;
+	(void)sbuf;
+	return 0;
+}
+
+#endif /* RCORPUS_ALTREP */
+
+
+/*
+ * Check that the stored texts are valid UTF-8, and that their attributes
+ * agree with their contents. Reading a file skips this by default, since
+ * write_corpus() only stores validated texts.
+ */
+static void corpus_file_validate(const struct corpus_file *file)
+{
+	struct utf8lite_text text, check;
+	struct utf8lite_message msg;
+	int64_t i;
+
+	for (i = 0; i < file->nrow; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (corpus_file_text(file, i, &text)) {
+			error("file '%s' is not a valid corpus file",
+			      file->buf->file_name);
+		}
+		if (!text.ptr) {
+			continue;
+		}
+
+		if (utf8lite_text_assign(&check, text.ptr,
+					 UTF8LITE_TEXT_SIZE(&text), 0,
+					 &msg)) {
+			error("text in row %"PRIu64" of corpus file '%s'"
+			      " contains malformed UTF-8: %s",
+			      (uint64_t)i + 1, file->buf->file_name,
+			      msg.string);
+		}
+		if (check.attr != text.attr) {
+			error("text in row %"PRIu64" of corpus file '%s'"
+			      " has invalid attributes", (uint64_t)i + 1,
+			      file->buf->file_name);
+		}
+	}
+}
+
+
+/*
+ * Make a text object whose source is the file. This only reads the
+ * header; the table columns and the text array get computed from the
+ * row attributes in the file when something asks for them.
+ */
+SEXP corpus_file_read(SEXP sfile, SEXP snames, SEXP sfilter,
+		      SEXP svalidate)
+{
+	SEXP ans, sbuf, sources, source, row, start, stop;
+	struct corpus_file file;
+	int nprot = 0;
+
+	PROTECT(sbuf = alloc_filebuf(sfile)); nprot++;
+	as_corpus_file(sbuf, &file);
+	if (file.nrow > R_XLEN_T_MAX) {
+		error("corpus file row count (%"PRId64") exceeds maximum",
+		      file.nrow);
+	}
+
+	if (LOGICAL(svalidate)[0] == TRUE) {
+		corpus_file_validate(&file);
+	}
+
+	PROTECT(sources = allocVector(VECSXP, 1)); nprot++;
+	SET_VECTOR_ELT(sources, 0, sbuf);
+
+	PROTECT(source = file_column(sbuf, FILE_SOURCE)); nprot++;
+	PROTECT(row = file_column(sbuf, FILE_ROW)); nprot++;
+	PROTECT(start = file_column(sbuf, FILE_START)); nprot++;
+	PROTECT(stop = file_column(sbuf, FILE_STOP)); nprot++;
+
+	PROTECT(ans = alloc_text(sources, source, row, start, stop, snames,
+				 sfilter)); nprot++;
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+struct context {
+	FILE *file;
+	const char *file_name;
+	uint64_t *attr;
+	uint64_t *offset;
+	uint8_t *buf;
+	size_t buf_size;
+};
+
+
+static void context_destroy(void *obj)
+{
+	struct context *ctx = obj;
+
+	if (ctx->file) {
+		fclose(ctx->file);
+	}
+	corpus_free(ctx->buf);
+	corpus_free(ctx->offset);
+	corpus_free(ctx->attr);
+}
+
+
+/* Decode the escapes in a text, returning the decoded size */
+static size_t context_unescape(struct context *ctx,
+			       const struct utf8lite_text *text)
+{
+	struct utf8lite_text_iter it;
+	size_t size = UTF8LITE_TEXT_SIZE(text);
+	uint8_t *ptr;
+	int err = 0;
+
+	// decoding never makes a text longer
+	if (size > ctx->buf_size) {
+		corpus_free(ctx->buf);
+		ctx->buf = NULL;
+		ctx->buf_size = 0;
+		TRY_ALLOC(ctx->buf = corpus_malloc(size));
+		ctx->buf_size = size;
+	}
+
+	ptr = ctx->buf;
+	utf8lite_text_iter_make(&it, text);
+	while (utf8lite_text_iter_advance(&it)) {
+		utf8lite_encode_utf8(it.current, &ptr);
+	}
+out:
+	CHECK_ERROR(err);
+	return (size_t)(ptr - ctx->buf);
+}
+
+
+static void context_write_header(struct context *ctx, int64_t nrow,
+				 int64_t meta_size, int64_t data_size)
+{
+	FILE *file = ctx->file;
+	const char *name = ctx->file_name;
+
+	if (fseek(file, 0, SEEK_SET) != 0) {
+		error("failed writing to file '%s'", name);
+	}
+
+	write_file(file, name, CORPUS_FILE_MAGIC, 1, 8);
+	write_file(file, name, &nrow, sizeof(nrow), 1);
+	write_file(file, name, &meta_size, sizeof(meta_size), 1);
+	write_file(file, name, &data_size, sizeof(data_size), 1);
+}
+
+
+static void context_write_pad(struct context *ctx, int64_t size)
+{
+	const uint8_t zero[8] = { 0 };
+
+	write_file(ctx->file, ctx->file_name, zero, 1,
+		   (size_t)(PAD8(size) - size));
+}
+
+
+SEXP corpus_file_write(SEXP sx, SEXP smeta, SEXP sfile)
+{
+	SEXP sctx;
+	struct context *ctx;
+	const struct utf8lite_text *text;
+	const uint8_t *ptr;
+	int64_t nrow, meta_size, data_size;
+	size_t size;
+	R_xlen_t i, n;
+	int err = 0, nprot = 0;
+
+	text = as_text(sx, &n);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+	ctx = as_context(sctx);
+
+	nrow = (int64_t)n;
+	meta_size = (int64_t)XLENGTH(smeta);
+	data_size = 0;
+
+	TRY_ALLOC(ctx->attr = corpus_malloc(n * sizeof(*ctx->attr) + 1));
+	TRY_ALLOC(ctx->offset = corpus_malloc(n * sizeof(*ctx->offset) + 1));
+
+	ctx->file_name = file_path(sfile);
+	ctx->file = open_file(ctx->file_name);
+
+	// leave room for the header; it gets written at the end
+	context_write_header(ctx, nrow, meta_size, data_size);
+
+	write_file(ctx->file, ctx->file_name, RAW(smeta), 1,
+		   (size_t)meta_size);
+	context_write_pad(ctx, meta_size);
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		ctx->offset[i] = (uint64_t)data_size;
+
+		if (!text[i].ptr) {
+			ctx->attr[i] = CORPUS_FILE_NA;
+			continue;
+		}
+
+		if (UTF8LITE_TEXT_HAS_ESC(&text[i])) {
+			size = context_unescape(ctx, &text[i]);
+			ptr = ctx->buf;
+		} else {
+			size = UTF8LITE_TEXT_SIZE(&text[i]);
+			ptr = text[i].ptr;
+		}
+
+		write_file(ctx->file, ctx->file_name, ptr, 1, size);
+		ctx->attr[i] = (uint64_t)((text[i].attr
+					   & UTF8LITE_TEXT_UTF8_BIT) | size);
+		data_size += (int64_t)size;
+	}
+	context_write_pad(ctx, data_size);
+
+	write_file(ctx->file, ctx->file_name, ctx->attr, sizeof(*ctx->attr),
+		   (size_t)n);
+	write_file(ctx->file, ctx->file_name, ctx->offset,
+		   sizeof(*ctx->offset), (size_t)n);
+
+	context_write_header(ctx, nrow, meta_size, data_size);
+
+	if (fclose(ctx->file) != 0) {
+		ctx->file = NULL;
+		error("failed writing to file '%s'", ctx->file_name);
+	}
+	ctx->file = NULL;
+out:
+	CHECK_ERROR(err);
+	free_context(sctx);
+	UNPROTECT(nprot);
+	return R_NilValue;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "rcorpus.h"
+
+/*
+ * A text filter file stores the state of a compiled text filter, in
+ * native byte order:
+ *
+ *     header:   char magic[8], int64 settings_size, int64 ntype,
+ *               int64 types_size, int64 nstem
+ *     settings: uint8 settings[settings_size]
+ *     stemmer:  string name
+ *     types:    string type[ntype]
+ *     stems:    (string type, string stem)[nstem]
+ *
+ * Each string is an int32 length followed by that many bytes of UTF-8;
+ * a length of -1 encodes a missing value. The settings are the filter
+ * properties, serialized by R. The types are in type ID order, so that
+ * loading them restores the vocabulary; 'types_size' is their size in
+ * bytes. The stems are the contents of the stemmer's cache, except for
+ * an R function stemmer: its name doesn't identify the function, so its
+ * stems never get saved.
+ */
+
+#define FILTER_FILE_MAGIC "corpusTF"
+#define FILTER_FILE_HEADER_SIZE (8 + 4 * sizeof(int64_t))
+
+
+struct context {
+	FILE *file;
+	const char *file_name;
+	int64_t settings_size;
+	int64_t ntype;
+	int64_t types_size;
+	int64_t nstem;
+};
+
+
+static void context_destroy(void *obj)
+{
+	struct context *ctx = obj;
+
+	if (ctx->file) {
+		fclose(ctx->file);
+	}
+}
+
+
+static void invalid_file(const char *name)
+{
+	error("file '%s' is not a valid text filter file", name);
+}
+
+
+static int read_string(const uint8_t **ptrptr, const uint8_t *end,
+		       struct utf8lite_text *text)
+{
+	struct utf8lite_message msg;
+	const uint8_t *ptr = *ptrptr;
+	int32_t len;
+
+	if ((size_t)(end - ptr) < sizeof(len)) {
+		return CORPUS_ERROR_INVAL;
+	}
+	memcpy(&len, ptr, sizeof(len));
+	ptr += sizeof(len);
+
+	if (len < 0) {
+		text->ptr = NULL;
+		text->attr = 0;
+	} else if ((size_t)(end - ptr) < (size_t)len) {
+		return CORPUS_ERROR_INVAL;
+	} else if (utf8lite_text_assign(text, ptr, (size_t)len, 0, &msg)) {
+		return CORPUS_ERROR_INVAL;
+	} else {
+		ptr += len;
+	}
+
+	*ptrptr = ptr;
+	return 0;
+}
+
+
+static size_t write_string(FILE *file, const char *name,
+			   const struct utf8lite_text *text)
+{
+	size_t size;
+	int32_t len;
+
+	if (!text->ptr) {
+		len = -1;
+		write_file(file, name, &len, sizeof(len), 1);
+		return sizeof(len);
+	}
+
+	size = UTF8LITE_TEXT_SIZE(text);
+	if (size > INT32_MAX) {
+		error("string length (%lu) exceeds maximum (%d)",
+		      (unsigned long)size, INT32_MAX);
+	}
+	len = (int32_t)size;
+
+	write_file(file, name, &len, sizeof(len), 1);
+	write_file(file, name, text->ptr, 1, size);
+	return sizeof(len) + size;
+}
+
+
+void filter_file_init(struct filter_file *file, SEXP sname)
+{
+	const char *name;
+	const uint8_t *ptr, *end;
+
+	name = file_path(sname);
+
+	errno = 0;
+	if (corpus_filebuf_init(&file->buf, name)) {
+		if (errno) {
+			error("cannot open file '%s': %s", name,
+			      strerror(errno));
+		} else {
+			error("cannot open file '%s'", name);
+		}
+	}
+
+	ptr = file->buf.map_addr;
+	end = ptr + file->buf.map_size;
+
+	if (file->buf.map_size < FILTER_FILE_HEADER_SIZE
+			|| memcmp(ptr, FILTER_FILE_MAGIC, 8) != 0) {
+		goto invalid;
+	}
+	ptr += 8;
+
+	memcpy(&file->settings_size, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&file->ntype, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&file->types_size, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&file->nstem, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+
+	if (file->settings_size < 0 || file->ntype < 0
+			|| file->ntype > INT32_MAX || file->types_size < 0
+			|| file->nstem < 0 || file->nstem > INT32_MAX
+			|| (uint64_t)(end - ptr)
+				< (uint64_t)file->settings_size) {
+		goto invalid;
+	}
+	file->settings = ptr;
+	ptr += file->settings_size;
+
+	if (read_string(&ptr, end, &file->stemmer)) {
+		goto invalid;
+	}
+
+	if ((uint64_t)(end - ptr) < (uint64_t)file->types_size) {
+		goto invalid;
+	}
+	file->types = ptr;
+	file->stems = ptr + file->types_size;
+	return;
+
+invalid:
+	corpus_filebuf_destroy(&file->buf);
+	invalid_file(name);
+}
+
+
+void filter_file_destroy(struct filter_file *file)
+{
+	corpus_filebuf_destroy(&file->buf);
+}
+
+
+/*
+ * Check whether the saved stems came from the filter's stemmer. Snowball
+ * stemmers match by name. A stemming function matches if it is the one
+ * that 'read_text_filter' loaded from this file, which it marks with the
+ * file's path; replacing the function drops the mark.
+ */
+static int filter_file_stemmer_matches(const struct filter_file *file,
+				       const struct stemmer *s, SEXP filter)
+{
+	SEXP stemmer, path, cache;
+
+	switch (s->type) {
+	case STEMMER_SNOWBALL:
+		return (file->stemmer.ptr
+			&& UTF8LITE_TEXT_SIZE(&file->stemmer)
+				== strlen(s->name)
+			&& memcmp(file->stemmer.ptr, s->name,
+				  strlen(s->name)) == 0);
+
+	case STEMMER_DICT:
+	case STEMMER_RFUNC:
+		stemmer = getListElement(filter, "stemmer");
+		path = getAttrib(stemmer, install("filter_file"));
+		cache = getListElement(filter, "cache");
+		return (isString(path) && LENGTH(path) == 1
+			&& isString(cache) && LENGTH(cache) == 1
+			&& STRING_ELT(path, 0) != NA_STRING
+			&& strcmp(CHAR(STRING_ELT(path, 0)),
+				  CHAR(STRING_ELT(cache, 0))) == 0);
+
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ * Add the saved stems to the stemmer's cache. The stems are only valid
+ * for the stemmer that produced them, so skip them for any other one.
+ */
+void filter_file_load_stems(const struct filter_file *file,
+			    struct stemmer *s, SEXP filter)
+{
+	struct utf8lite_text type, stem;
+	const uint8_t *ptr, *end;
+	const char *name = file->buf.file_name;
+	int64_t i;
+	int err = 0;
+
+	if (!filter_file_stemmer_matches(file, s, filter)) {
+		return;
+	}
+
+	ptr = file->stems;
+	end = (const uint8_t *)file->buf.map_addr + file->buf.map_size;
+
+	for (i = 0; i < file->nstem; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (read_string(&ptr, end, &type) || !type.ptr
+				|| read_string(&ptr, end, &stem)) {
+			invalid_file(name);
+		}
+
+		// the stems point into the file; they don't get copied
+		TRY(stemmer_cache(s, &type, &stem, 0));
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+/*
+ * Add the saved types to the filter, in their original order, so that
+ * the type IDs agree with the filter that wrote the file.
+ */
+void filter_file_load_types(const struct filter_file *file,
+			    struct corpus_filter *f)
+{
+	struct utf8lite_text type;
+	const uint8_t *ptr, *end;
+	const char *name = file->buf.file_name;
+	int64_t i;
+	int err = 0, type_id;
+
+	ptr = file->types;
+	end = file->stems;
+
+	for (i = 0; i < file->ntype; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (read_string(&ptr, end, &type) || !type.ptr) {
+			invalid_file(name);
+		}
+
+		TRY(corpus_filter_add_type(f, &type, &type_id));
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+static void context_write_header(struct context *ctx)
+{
+	FILE *file = ctx->file;
+	const char *name = ctx->file_name;
+
+	if (fseek(file, 0, SEEK_SET) != 0) {
+		error("failed writing to file '%s'", name);
+	}
+
+	write_file(file, name, FILTER_FILE_MAGIC, 1, 8);
+	write_file(file, name, &ctx->settings_size, sizeof(int64_t), 1);
+	write_file(file, name, &ctx->ntype, sizeof(int64_t), 1);
+	write_file(file, name, &ctx->types_size, sizeof(int64_t), 1);
+	write_file(file, name, &ctx->nstem, sizeof(int64_t), 1);
+}
+
+
+SEXP write_text_filter(SEXP sx, SEXP ssettings, SEXP sfile)
+{
+	SEXP sctx, stext;
+	struct context *ctx;
+	const struct corpus_filter *filter;
+	const struct stemmer *stemmer;
+	const struct stem_cache_item *item;
+	struct utf8lite_text name;
+	int i, nprot = 0;
+
+	PROTECT(stext = coerce_text(sx)); nprot++;
+	filter = text_filter(stext);
+	stemmer = text_stemmer(stext);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+	ctx = as_context(sctx);
+
+	ctx->file_name = file_path(sfile);
+	ctx->file = open_file(ctx->file_name);
+	ctx->settings_size = (int64_t)XLENGTH(ssettings);
+
+	// leave room for the header; it gets written at the end
+	context_write_header(ctx);
+
+	write_file(ctx->file, ctx->file_name, RAW(ssettings), 1,
+		   (size_t)XLENGTH(ssettings));
+
+	name.ptr = (uint8_t *)stemmer->name;
+	name.attr = stemmer->name ? strlen(stemmer->name) : 0;
+	write_string(ctx->file, ctx->file_name, &name);
+
+	for (i = 0; i < filter->symtab.ntype; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		ctx->types_size += write_string(ctx->file, ctx->file_name,
+						&filter->symtab.types[i].text);
+	}
+	ctx->ntype = filter->symtab.ntype;
+
+	if (stemmer->has_cache) {
+		for (i = 0; i < stemmer->cache.nitem; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			item = &stemmer->cache.items[i];
+			write_string(ctx->file, ctx->file_name, &item->type);
+			write_string(ctx->file, ctx->file_name, &item->stem);
+		}
+		ctx->nstem = stemmer->cache.nitem;
+	}
+
+	context_write_header(ctx);
+
+	if (fclose(ctx->file) != 0) {
+		ctx->file = NULL;
+		error("failed writing to file '%s'", ctx->file_name);
+	}
+	ctx->file = NULL;
+
+	free_context(sctx);
+	UNPROTECT(nprot);
+	return R_NilValue;
+}
+
+
+struct read_context {
+	struct filter_file file;
+	int has_file;
+};
+
+
+static void read_context_destroy(void *obj)
+{
+	struct read_context *ctx = obj;
+
+	if (ctx->has_file) {
+		filter_file_destroy(&ctx->file);
+	}
+}
+
+
+SEXP read_text_filter(SEXP sfile)
+{
+	SEXP ans, sctx;
+	struct read_context *ctx;
+	const struct filter_file *file;
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), read_context_destroy));
+	ctx = as_context(sctx);
+
+	filter_file_init(&ctx->file, sfile);
+	ctx->has_file = 1;
+	file = &ctx->file;
+
+	PROTECT(ans = allocVector(RAWSXP, (R_xlen_t)file->settings_size));
+	memcpy(RAW(ans), file->settings, (size_t)file->settings_size);
+
+	free_context(sctx);
+	UNPROTECT(2);
+	return ans;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+#include "rcorpus.h"
+
+/*
+ * Read a gzip-compressed file in blocks, alternating between two block
+ * buffers, so that one block can be inflated while the previous one gets
+ * processed. Reading a block doesn't call R, so it can run on a worker
+ * thread; only one thread may read from the stream at a time.
+ */
+
+#define GZIP_BLOCK (1024 * 1024)
+#define GZIP_IOBUF (128 * 1024)
+
+// deflate expands its input by at most a factor of about 1032
+#define GZIP_MAX_RATIO 1032
+
+
+int gzip_stream_open(struct gzip_stream *gz, const char *name)
+{
+	int k;
+
+	gz->file = NULL;
+	for (k = 0; k < 2; k++) {
+		gz->block[k] = NULL;
+		gz->size[k] = 0;
+	}
+	gz->error = 0;
+
+	for (k = 0; k < 2; k++) {
+		if (!(gz->block[k] = corpus_malloc(GZIP_BLOCK))) {
+			goto nomem;
+		}
+	}
+
+	if (!(gz->file = gzopen(name, "rb"))) {
+		gzip_stream_close(gz);
+		return CORPUS_ERROR_OS;
+	}
+	gzbuffer((gzFile)gz->file, GZIP_IOBUF);
+	return 0;
+
+nomem:
+	gzip_stream_close(gz);
+	return CORPUS_ERROR_NOMEM;
+}
+
+
+void gzip_stream_close(struct gzip_stream *gz)
+{
+	if (gz->file) {
+		gzclose((gzFile)gz->file);
+		gz->file = NULL;
+	}
+	corpus_free(gz->block[1]);
+	corpus_free(gz->block[0]);
+	gz->block[1] = NULL;
+	gz->block[0] = NULL;
+}
+
+
+/*
+ * Inflate the next block of the file into buffer 'k'. At the end of the
+ * file, the block is empty. On failure, the block is empty and the stream
+ * has a nonzero error. A file that ends in the middle of a gzip member
+ * reads to an empty block with a Z_BUF_ERROR, rather than a negative
+ * count, so check for that to avoid treating a truncated file as a
+ * shorter one.
+ */
+void gzip_stream_read(struct gzip_stream *gz, int k)
+{
+	int nread, errnum;
+
+	gz->size[k] = 0;
+	if (gz->error) {
+		return;
+	}
+
+	nread = gzread((gzFile)gz->file, gz->block[k], GZIP_BLOCK);
+	if (nread < 0) {
+		gz->error = CORPUS_ERROR_INVAL;
+	} else if (nread == 0) {
+		gzerror((gzFile)gz->file, &errnum);
+		if (errnum != Z_OK) {
+			gz->error = CORPUS_ERROR_INVAL;
+		}
+	} else {
+		gz->size[k] = (size_t)nread;
+	}
+}
+
+
+/*
+ * Guess the size of the decompressed data from the gzip trailer, which
+ * stores the size modulo 2^32 of the last member. The guess is exact for
+ * a file with a single member of less than 4 GB. The trailer isn't
+ * validated until the end, so cap the guess at the largest size that
+ * deflate can produce from the compressed data; past that, the reader
+ * grows its buffer instead.
+ */
+size_t gzip_size_hint(const char *name)
+{
+	FILE *file;
+	uint8_t trailer[4];
+	long end;
+	size_t size = 0, max;
+
+	if (!(file = fopen(name, "rb"))) {
+		return 0;
+	}
+
+	if (fseek(file, -4, SEEK_END) == 0
+			&& fread(trailer, 1, 4, file) == 4
+			&& (end = ftell(file)) > 0) {
+		size = ((size_t)trailer[0]
+			| ((size_t)trailer[1] << 8)
+			| ((size_t)trailer[2] << 16)
+			| ((size_t)trailer[3] << 24));
+
+		if ((size_t)end > SIZE_MAX / GZIP_MAX_RATIO) {
+			max = SIZE_MAX;
+		} else {
+			max = (size_t)end * GZIP_MAX_RATIO;
+		}
+		if (size > max) {
+			size = max;
+		}
+	}
+
+	fclose(file);
+	return size;
+}
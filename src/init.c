@@ -24,35 +24,45 @@
 
 static const R_CallMethodDef CallEntries[] = {
 	CALLDEF(abbreviations, 1),
-	CALLDEF(alloc_text_handle, 0),
+	CALLDEF(alloc_stem_dict, 3),
+	CALLDEF(alloc_text_handle, 1),
 	CALLDEF(anyNA_text, 1),
 	CALLDEF(as_character_json, 1),
 	CALLDEF(as_character_text, 1),
 	CALLDEF(as_integer_json, 1),
 	CALLDEF(as_double_json, 1),
-	CALLDEF(as_list_json, 1),
+	CALLDEF(as_list_json, 2),
 	CALLDEF(as_logical_json, 1),
 	CALLDEF(as_text_character, 2),
 	CALLDEF(as_text_filter_connector, 1),
 	CALLDEF(as_text_json, 2),
+	CALLDEF(corpus_file_meta, 1),
+	CALLDEF(corpus_file_read, 4),
+	CALLDEF(corpus_file_write, 3),
 	CALLDEF(dim_json, 1),
 	CALLDEF(is_na_text, 1),
 	CALLDEF(length_json, 1),
 	CALLDEF(length_text, 1),
 	CALLDEF(logging_off, 0),
 	CALLDEF(logging_on, 0),
-	CALLDEF(mmap_ndjson, 2),
+	CALLDEF(mmap_ndjson, 5),
 	CALLDEF(names_json, 1),
 	CALLDEF(names_text, 1),
+	CALLDEF(ndjson_index_valid, 2),
 	CALLDEF(print_json, 1),
-	CALLDEF(read_ndjson, 2),
+	CALLDEF(read_ndjson, 4),
+	CALLDEF(read_ndjson_gzip, 4),
+	CALLDEF(read_term_matrix, 4),
+	CALLDEF(read_text_filter, 1),
 	CALLDEF(simplify_json, 1),
-	CALLDEF(stem_snowball, 2),
+	CALLDEF(stem_dict, 2),
+	CALLDEF(stem_snowball, 3),
 	CALLDEF(stopwords, 1),
 	CALLDEF(subscript_json, 2),
 	CALLDEF(subset_json, 3),
-	CALLDEF(term_stats, 7),
-	CALLDEF(term_matrix, 4),
+	CALLDEF(term_stats, 9),
+	CALLDEF(term_stats_ndjson, 10),
+	CALLDEF(term_matrix, 8),
 	CALLDEF(text_c, 3),
 	CALLDEF(text_count, 2),
 	CALLDEF(text_detect, 2),
@@ -61,13 +71,18 @@ static const R_CallMethodDef CallEntries[] = {
 	CALLDEF(text_nsentence, 1),
 	CALLDEF(text_ntoken, 1),
 	CALLDEF(text_ntype, 2),
-	CALLDEF(text_split_sentences, 2),
-	CALLDEF(text_split_tokens, 2),
+	CALLDEF(text_split_sentences, 3),
+	CALLDEF(text_split_tokens, 3),
 	CALLDEF(text_sub, 3),
 	CALLDEF(text_trunc, 3),
+	CALLDEF(text_token_ids, 1),
 	CALLDEF(text_tokens, 1),
+	CALLDEF(text_tokens_ragged, 2),
 	CALLDEF(text_types, 2),
 	CALLDEF(text_valid, 1),
+	CALLDEF(write_ndjson_index, 2),
+	CALLDEF(write_term_matrix, 6),
+	CALLDEF(write_text_filter, 3),
         {NULL, NULL, 0}
 };
 
@@ -77,4 +92,8 @@ void R_init_corpus(DllInfo *dll)
 	R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
 	R_useDynamicSymbols(dll, FALSE);
 	R_forceSymbols(dll, TRUE);
+#ifdef RCORPUS_ALTREP
+	init_text_altrep(dll);
+	init_corpus_file_altrep(dll);
+#endif
 }
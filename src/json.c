@@ -15,6 +15,8 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <float.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -138,18 +140,1089 @@ out:
 }
 
 
-static void json_load(SEXP sdata)
+static const uint8_t json_null[] = "null";
+
+
+static const uint8_t *json_skip_space(const uint8_t *ptr,
+				      const uint8_t *end)
+{
+	while (ptr != end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n'
+			      || *ptr == '\r')) {
+		ptr++;
+	}
+	return ptr;
+}
+
+
+/* Skip a string, starting at its opening quote; NULL if it's malformed */
+static const uint8_t *json_skip_string(const uint8_t *ptr,
+				       const uint8_t *end)
+{
+	int i;
+
+	ptr++;
+	while (ptr != end) {
+		if (*ptr == '\\') {
+			if (++ptr == end) {
+				break;
+			}
+			switch (*ptr) {
+			case '"':
+			case '\\':
+			case '/':
+			case 'b':
+			case 'f':
+			case 'n':
+			case 'r':
+			case 't':
+				break;
+			case 'u':
+				for (i = 0; i < 4; i++) {
+					if (++ptr == end || !isxdigit(*ptr)) {
+						return NULL;
+					}
+				}
+				break;
+			default:
+				return NULL;
+			}
+		} else if (*ptr == '"') {
+			return ptr + 1;
+		} else if (*ptr < 0x20) {
+			return NULL;
+		}
+		ptr++;
+	}
+	return NULL;
+}
+
+
+static const uint8_t *json_skip_literal(const uint8_t *ptr,
+					const uint8_t *end, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	if ((size_t)(end - ptr) < len || memcmp(ptr, lit, len) != 0) {
+		return NULL;
+	}
+	return ptr + len;
+}
+
+
+static const uint8_t *json_skip_number(const uint8_t *ptr,
+				       const uint8_t *end)
+{
+	const uint8_t *digits;
+
+	if (ptr != end && *ptr == '-') {
+		ptr++;
+	}
+	if (ptr == end || !isdigit(*ptr)) {
+		return NULL;
+	}
+	if (*ptr == '0') {
+		ptr++;
+	} else {
+		while (ptr != end && isdigit(*ptr)) {
+			ptr++;
+		}
+	}
+	if (ptr != end && *ptr == '.') {
+		digits = ++ptr;
+		while (ptr != end && isdigit(*ptr)) {
+			ptr++;
+		}
+		if (ptr == digits) {
+			return NULL;
+		}
+	}
+	if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+		ptr++;
+		if (ptr != end && (*ptr == '+' || *ptr == '-')) {
+			ptr++;
+		}
+		digits = ptr;
+		while (ptr != end && isdigit(*ptr)) {
+			ptr++;
+		}
+		if (ptr == digits) {
+			return NULL;
+		}
+	}
+	return ptr;
+}
+
+
+/*
+ * Skip a value, checking its syntax but without typing it. Return NULL
+ * if the value is malformed. The open brackets go on a stack that starts
+ * out on the C stack and moves to the heap for deeply nested values.
+ */
+static const uint8_t *json_skip_value(const uint8_t *ptr,
+				      const uint8_t *end)
+{
+	uint8_t local[256], *stack = local, *heap = NULL;
+	size_t depth = 0, depth_max = sizeof(local);
+
+value:
+	ptr = json_skip_space(ptr, end);
+	if (ptr == end) {
+		goto fail;
+	}
+	switch (*ptr) {
+	case '"':
+		if (!(ptr = json_skip_string(ptr, end))) {
+			goto fail;
+		}
+		goto next;
+
+	case '{':
+	case '[':
+		if (depth == depth_max) {
+			if (depth_max > SIZE_MAX / 2) {
+				goto fail;
+			}
+			if (!(heap = corpus_realloc(heap, 2 * depth_max))) {
+				goto fail;
+			}
+			if (stack == local) {
+				memcpy(heap, local, depth);
+			}
+			stack = heap;
+			depth_max *= 2;
+		}
+		stack[depth++] = *ptr;
+		ptr = json_skip_space(ptr + 1, end);
+		if (ptr != end && *ptr == (stack[depth - 1] == '{' ? '}' : ']')) {
+			depth--;
+			ptr++;
+			goto next;
+		}
+		if (stack[depth - 1] == '{') {
+			goto key;
+		}
+		goto value;
+
+	case 't':
+		ptr = json_skip_literal(ptr, end, "true");
+		break;
+	case 'f':
+		ptr = json_skip_literal(ptr, end, "false");
+		break;
+	case 'n':
+		ptr = json_skip_literal(ptr, end, "null");
+		break;
+	default:
+		ptr = json_skip_number(ptr, end);
+		break;
+	}
+	if (!ptr) {
+		goto fail;
+	}
+
+next:
+	if (depth == 0) {
+		corpus_free(heap);
+		return ptr;
+	}
+	ptr = json_skip_space(ptr, end);
+	if (ptr == end) {
+		goto fail;
+	}
+	if (*ptr == ',') {
+		ptr++;
+		if (stack[depth - 1] == '{') {
+			goto key;
+		}
+		goto value;
+	}
+	if (*ptr != (stack[depth - 1] == '{' ? '}' : ']')) {
+		goto fail;
+	}
+	depth--;
+	ptr++;
+	goto next;
+
+key:
+	ptr = json_skip_space(ptr, end);
+	if (ptr == end || *ptr != '"'
+			|| !(ptr = json_skip_string(ptr, end))) {
+		goto fail;
+	}
+	ptr = json_skip_space(ptr, end);
+	if (ptr == end || *ptr != ':') {
+		goto fail;
+	}
+	ptr++;
+	goto value;
+
+fail:
+	corpus_free(heap);
+	return NULL;
+}
+
+
+static int json_key_equals(const uint8_t *ptr, size_t size,
+			   const struct utf8lite_text *name)
+{
+	struct utf8lite_text key;
+	struct utf8lite_text_iter it;
+	uint8_t buf[4], *buf_end;
+	size_t len, pos = 0, name_size = UTF8LITE_TEXT_SIZE(name);
+
+	if (!memchr(ptr, '\\', size)) {
+		return (size == name_size
+			&& memcmp(ptr, name->ptr, name_size) == 0);
+	}
+
+	// decode the escapes, comparing as we go
+	if (utf8lite_text_assign(&key, ptr, size, UTF8LITE_TEXT_UNESCAPE,
+				 NULL)) {
+		return 0;
+	}
+	utf8lite_text_iter_make(&it, &key);
+	while (utf8lite_text_iter_advance(&it)) {
+		buf_end = buf;
+		utf8lite_encode_utf8(it.current, &buf_end);
+		len = (size_t)(buf_end - buf);
+		if (len > name_size - pos
+				|| memcmp(buf, name->ptr + pos, len) != 0) {
+			return 0;
+		}
+		pos += len;
+	}
+	return pos == name_size;
+}
+
+
+/*
+ * Find the value of a top-level field in a record, checking the syntax of
+ * the other fields but without typing them. If the record doesn't have
+ * the field, the value is null. If the line isn't a record, the value
+ * is NULL, and the caller should parse the whole line instead.
+ */
+static int json_project(const uint8_t *ptr, size_t size,
+			const struct utf8lite_text *name,
+			const uint8_t **valptr, size_t *sizeptr)
+{
+	const uint8_t *end = ptr + size, *key, *key_end, *val;
+
+	*valptr = NULL;
+	*sizeptr = 0;
+
+	ptr = json_skip_space(ptr, end);
+	if (ptr == end || *ptr != '{') {
+		return 0;
+	}
+
+	*valptr = json_null;
+	*sizeptr = sizeof(json_null) - 1;
+
+	ptr = json_skip_space(ptr + 1, end);
+	if (ptr != end && *ptr == '}') {
+		goto close;
+	}
+
+	for (;;) {
+		if (ptr == end || *ptr != '"') {
+			return CORPUS_ERROR_INVAL;
+		}
+		key = ptr + 1;
+		if (!(ptr = json_skip_string(ptr, end))) {
+			return CORPUS_ERROR_INVAL;
+		}
+		key_end = ptr - 1;
+
+		ptr = json_skip_space(ptr, end);
+		if (ptr == end || *ptr != ':') {
+			return CORPUS_ERROR_INVAL;
+		}
+
+		val = json_skip_space(ptr + 1, end);
+		if (!(ptr = json_skip_value(val, end))) {
+			return CORPUS_ERROR_INVAL;
+		}
+
+		// keep the first match, but check the rest of the record
+		if (*valptr == json_null
+				&& json_key_equals(key, (size_t)(key_end - key),
+						   name)) {
+			*valptr = val;
+			*sizeptr = (size_t)(ptr - val);
+		}
+
+		ptr = json_skip_space(ptr, end);
+		if (ptr != end && *ptr == '}') {
+			break;
+		} else if (ptr == end || *ptr != ',') {
+			return CORPUS_ERROR_INVAL;
+		}
+		ptr = json_skip_space(ptr + 1, end);
+	}
+
+close:
+	// only white space can follow the record
+	if (json_skip_space(ptr + 1, end) != end) {
+		return CORPUS_ERROR_INVAL;
+	}
+	return 0;
+}
+
+
+/*
+ * Assign the value of a field in a line. Lines that aren't records get
+ * parsed in full, so that malformed lines still raise an error, but the
+ * field value is null.
+ */
+static int json_assign_field(struct corpus_data *data,
+			     struct corpus_schema *schema,
+			     const uint8_t *line, size_t line_size,
+			     const struct utf8lite_text *field)
+{
+	const uint8_t *ptr;
+	size_t size;
+	int err = 0;
+
+	TRY(json_project(line, line_size, field, &ptr, &size));
+	if (!ptr) {
+		TRY(corpus_data_assign(data, schema, line, line_size));
+		ptr = json_null;
+		size = sizeof(json_null) - 1;
+	}
+	TRY(corpus_data_assign(data, schema, ptr, size));
+out:
+	return err;
+}
+
+
+/*
+ * Find the text of a top-level field in a line, checking the syntax of
+ * the line but without typing any of its values. The text is NA if the
+ * line isn't a record, or if the field is missing or isn't a string.
+ */
+int json_field_text(const uint8_t *line, size_t line_size,
+		    const struct utf8lite_text *field,
+		    struct utf8lite_text *text)
+{
+	const uint8_t *ptr, *end = line + line_size;
+	size_t size;
+	int err = 0;
+
+	text->ptr = NULL;
+	text->attr = 0;
+
+	TRY(json_project(line, line_size, field, &ptr, &size));
+
+	if (!ptr) {
+		ptr = json_skip_space(line, end);
+		if (ptr != end && (!(ptr = json_skip_value(ptr, end))
+				   || json_skip_space(ptr, end) != end)) {
+			err = CORPUS_ERROR_INVAL;
+		}
+		goto out;
+	}
+
+	if (*ptr != '"') {
+		goto out;
+	}
+
+	// drop the quotes; this checks the UTF-8 and the escapes
+	TRY(utf8lite_text_assign(text, ptr + 1, size - 2,
+				 UTF8LITE_TEXT_UNESCAPE, NULL));
+out:
+	return err;
+}
+
+
+/*
+ * A chunk of ndjson lines, parsed on its own thread. The types in the
+ * chunk schema get remapped to the shared schema after the parse.
+ */
+struct json_chunk {
+	struct corpus_schema schema;
+	struct corpus_data *rows;
+	const struct utf8lite_text *field;
+	const uint8_t *begin;
+	const uint8_t *end;
+	R_xlen_t nrow;
+	R_xlen_t nrow_max;
+	int type_id;
+	int has_schema;
+	int error;
+};
+
+
+struct json_context {
+	struct json_chunk *chunks;
+	int *type_map;
+	int *name_map;
+	int nchunk;
+};
+
+
+static void json_context_destroy(void *obj)
+{
+	struct json_context *ctx = obj;
+	int k;
+
+	for (k = 0; k < ctx->nchunk; k++) {
+		if (ctx->chunks[k].has_schema) {
+			corpus_schema_destroy(&ctx->chunks[k].schema);
+		}
+		corpus_free(ctx->chunks[k].rows);
+	}
+	corpus_free(ctx->name_map);
+	corpus_free(ctx->type_map);
+	corpus_free(ctx->chunks);
+}
+
+
+/* Split a buffer into chunks that start at the beginnings of lines */
+static void json_context_split(struct json_context *ctx,
+			       const uint8_t *begin, const uint8_t *end)
+{
+	const uint8_t *ptr, *prev = begin;
+	size_t size = (size_t)(end - begin);
+	int k;
+
+	for (k = 0; k < ctx->nchunk; k++) {
+		if (k + 1 == ctx->nchunk) {
+			ptr = end;
+		} else {
+			ptr = begin + (size / ctx->nchunk) * (k + 1);
+			if (ptr < prev) {
+				ptr = prev;
+			}
+			if (ptr != begin && ptr[-1] != '\n') {
+				ptr = line_next(ptr, end);
+			}
+		}
+		ctx->chunks[k].begin = prev;
+		ctx->chunks[k].end = ptr;
+		prev = ptr;
+	}
+}
+
+
+/*
+ * Parse the lines in a chunk, or if the chunk has a field, the values of
+ * that field. This doesn't call R, so it's thread-safe.
+ */
+static void json_chunk_parse(struct json_chunk *chunk)
+{
+	struct line_iter it;
+	void *base;
+	size_t size;
+	int err = 0;
+
+	line_iter_make(&it, chunk->begin, chunk->end);
+	while (line_iter_advance(&it)) {
+		if (chunk->nrow == chunk->nrow_max) {
+			base = chunk->rows;
+			size = (size_t)chunk->nrow_max;
+			TRY(corpus_bigarray_grow(&base, &size,
+						 sizeof(*chunk->rows),
+						 size, 1));
+			chunk->rows = base;
+			chunk->nrow_max = (R_xlen_t)size;
+		}
+
+		if (chunk->field) {
+			TRY(json_assign_field(&chunk->rows[chunk->nrow],
+					      &chunk->schema, it.ptr, it.size,
+					      chunk->field));
+		} else {
+			TRY(corpus_data_assign(&chunk->rows[chunk->nrow],
+					       &chunk->schema, it.ptr,
+					       it.size));
+		}
+
+		TRY(corpus_schema_union(&chunk->schema, chunk->type_id,
+					chunk->rows[chunk->nrow].type_id,
+					&chunk->type_id));
+		chunk->nrow++;
+	}
+out:
+	chunk->error = err;
+}
+
+
+/*
+ * Add the chunk's names and types to the shared schema, recording the new
+ * IDs. A type's components always have smaller IDs than the type itself,
+ * so one pass in ID order suffices. Adding the names in chunk order makes
+ * the name IDs, and so the field order, the same as for a serial parse.
+ */
+static int json_chunk_remap(const struct json_chunk *chunk,
+			    struct corpus_schema *schema,
+			    int *type_map, int *name_map)
+{
+	const struct corpus_schema *s = &chunk->schema;
+	const struct corpus_datatype *t;
+	const struct corpus_datatype_record *r;
+	int *type_ids, *name_ids;
+	int err = 0, i, id, j, nfield;
+
+	for (i = 0; i < s->names.ntype; i++) {
+		TRY(corpus_schema_name(schema, &s->names.types[i].text,
+				       &name_map[i]));
+	}
+
+	for (id = 0; id < s->ntype; id++) {
+		t = &s->types[id];
+		switch (t->kind) {
+		case CORPUS_DATATYPE_ARRAY:
+			i = t->meta.array.type_id;
+			TRY(corpus_schema_array(schema, i < 0 ? i : type_map[i],
+						t->meta.array.length,
+						&type_map[id]));
+			break;
+
+		case CORPUS_DATATYPE_RECORD:
+			r = &t->meta.record;
+			nfield = r->nfield;
+			type_ids = (int *)R_alloc(nfield + 1, sizeof(int));
+			name_ids = (int *)R_alloc(nfield + 1, sizeof(int));
+			for (j = 0; j < nfield; j++) {
+				i = r->type_ids[j];
+				type_ids[j] = i < 0 ? i : type_map[i];
+				name_ids[j] = name_map[r->name_ids[j]];
+			}
+			TRY(corpus_schema_record(schema, type_ids, name_ids,
+						 nfield, &type_map[id]));
+			break;
+
+		default:
+			// atomic types have the same IDs in every schema
+			type_map[id] = id;
+			break;
+		}
+	}
+out:
+	return err;
+}
+
+
+/*
+ * Append a parsed chunk's rows to the parent, translating their types to
+ * the parent's schema, then release the chunk.
+ */
+static void json_chunk_merge(struct json_context *ctx,
+			     struct json_chunk *chunk, struct json *parent,
+			     R_xlen_t *nrowptr, int *type_idptr)
+{
+	const void *vmax;
+	R_xlen_t i, nrow = *nrowptr;
+	int err = 0, ntype, nname, type_id = *type_idptr;
+
+	ntype = chunk->schema.ntype;
+	nname = chunk->schema.names.ntype;
+	corpus_free(ctx->type_map);
+	corpus_free(ctx->name_map);
+	ctx->type_map = NULL;
+	ctx->name_map = NULL;
+	TRY_ALLOC(ctx->type_map = corpus_malloc((ntype + 1)
+					* sizeof(*ctx->type_map)));
+	TRY_ALLOC(ctx->name_map = corpus_malloc((nname + 1)
+					* sizeof(*ctx->name_map)));
+
+	vmax = vmaxget();
+	err = json_chunk_remap(chunk, &parent->schema, ctx->type_map,
+			       ctx->name_map);
+	vmaxset(vmax);
+	TRY(err);
+
+	for (i = 0; i < chunk->nrow; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		parent->rows[nrow] = chunk->rows[i];
+		if (chunk->rows[i].type_id >= 0) {
+			parent->rows[nrow].type_id =
+				ctx->type_map[chunk->rows[i].type_id];
+		}
+		TRY(corpus_schema_union(&parent->schema, type_id,
+					parent->rows[nrow].type_id,
+					&type_id));
+		nrow++;
+	}
+
+	// release the chunk as soon as it's merged
+	corpus_schema_destroy(&chunk->schema);
+	chunk->has_schema = 0;
+	corpus_free(chunk->rows);
+	chunk->rows = NULL;
+
+	*nrowptr = nrow;
+	*type_idptr = type_id;
+out:
+	CHECK_ERROR(err);
+}
+
+
+/*
+ * Parse the rows of a buffer on multiple threads, each with its own
+ * schema, then merge the results into the parent, in order.
+ */
+static void json_load_parallel(struct json *parent, const uint8_t *begin,
+			       const uint8_t *end,
+			       const struct utf8lite_text *field, int nthread)
+{
+	SEXP sctx;
+	struct json_context *ctx;
+	struct json_chunk *chunk;
+	R_xlen_t nrow;
+	int err = 0, k, type_id;
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), json_context_destroy));
+	ctx = as_context(sctx);
+
+	TRY_ALLOC(ctx->chunks = corpus_calloc(nthread, sizeof(*ctx->chunks)));
+	ctx->nchunk = nthread;
+
+	for (k = 0; k < nthread; k++) {
+		chunk = &ctx->chunks[k];
+		TRY(corpus_schema_init(&chunk->schema));
+		chunk->has_schema = 1;
+		chunk->field = field;
+		chunk->type_id = CORPUS_DATATYPE_NULL;
+	}
+
+	json_context_split(ctx, begin, end);
+
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(nthread)
+#endif
+	for (k = 0; k < nthread; k++) {
+		json_chunk_parse(&ctx->chunks[k]);
+	}
+
+	nrow = 0;
+	for (k = 0; k < nthread; k++) {
+		chunk = &ctx->chunks[k];
+		CHECK_ERROR_FORMAT(chunk->error,
+				   "failed parsing row %"PRIu64" of JSON data",
+				   (uint64_t)(nrow + chunk->nrow + 1));
+		if (chunk->nrow > R_XLEN_T_MAX - nrow) {
+			TRY(CORPUS_ERROR_OVERFLOW);
+		}
+		nrow += chunk->nrow;
+	}
+
+	parent->rows = realloc_nonnull(parent->rows,
+				       nrow * sizeof(*parent->rows));
+	type_id = CORPUS_DATATYPE_NULL;
+	nrow = 0;
+
+	for (k = 0; k < nthread; k++) {
+		json_chunk_merge(ctx, &ctx->chunks[k], parent, &nrow,
+				 &type_id);
+	}
+
+	parent->nrow = nrow;
+	parent->type_id = type_id;
+out:
+	CHECK_ERROR(err);
+	free_context(sctx);
+	UNPROTECT(1);
+}
+
+
+struct gzip_context {
+	struct gzip_stream gz;
+	int has_gz;
+};
+
+
+static void gzip_context_destroy(void *obj)
+{
+	struct gzip_context *ctx = obj;
+
+	if (ctx->has_gz) {
+		gzip_stream_close(&ctx->gz);
+	}
+}
+
+
+/* Point a chunk's rows into a new copy of the buffer they came from */
+static void json_chunk_rebase(struct json_chunk *chunk, const uint8_t *old,
+			      const uint8_t *new)
+{
+	R_xlen_t i;
+
+	for (i = 0; i < chunk->nrow; i++) {
+		// missing fields point to a constant, not into the buffer
+		if (chunk->rows[i].ptr != json_null) {
+			chunk->rows[i].ptr = new + (chunk->rows[i].ptr - old);
+		}
+	}
+}
+
+
+/*
+ * Append a block of decompressed data to the buffer, then parse the
+ * lines that it completes into each chunk. This doesn't call R, so it can
+ * run while the next block gets decompressed.
+ */
+static void json_gzip_consume(struct json_context *ctx, uint8_t *buf,
+			      size_t *sizeptr, size_t *parsedptr,
+			      const uint8_t *block, size_t block_size)
+{
+	struct json_chunk *chunk;
+	size_t size = *sizeptr, parsed = *parsedptr, end, start;
+	int k;
+
+	memcpy(buf + size, block, block_size);
+	size += block_size;
+
+	// everything before this block was parsed up to its last newline,
+	// so only look for the last complete line within the block
+	start = size - block_size;
+	if (start < parsed) {
+		start = parsed;
+	}
+	end = size;
+	while (end > start && buf[end - 1] != '\n') {
+		end--;
+	}
+	if (end == start) {
+		end = parsed;
+	}
+
+	for (k = 0; k < ctx->nchunk && end > parsed; k++) {
+		chunk = &ctx->chunks[k];
+		chunk->begin = buf + parsed;
+		chunk->end = buf + end;
+		json_chunk_parse(chunk);
+		if (chunk->error) {
+			break;
+		}
+	}
+
+	*sizeptr = size;
+	*parsedptr = end;
+}
+
+
+static void json_gzip_check(const struct json_context *ctx)
+{
+	const struct json_chunk *chunk;
+	int k;
+
+	for (k = 0; k < ctx->nchunk; k++) {
+		chunk = &ctx->chunks[k];
+		CHECK_ERROR_FORMAT(chunk->error,
+				   "failed parsing row %"PRIu64" of JSON data",
+				   (uint64_t)(chunk->nrow + 1));
+	}
+}
+
+
+/*
+ * Decompress a gzip-compressed ndjson file, parsing its lines as they
+ * arrive. A worker thread inflates the next block of the file while the
+ * calling thread appends the previous block to the buffer and parses the
+ * lines that it completes, once for each of the unloaded JSON objects in
+ * the list 'objs'. Set each object's buffer to the decompressed data, and
+ * return that buffer.
+ */
+SEXP json_load_gzip(SEXP sfile, SEXP sobjs)
+{
+	SEXP sbuffer, sbuffer2, sctx, sgz, sobj, sfield;
+	PROTECT_INDEX ipx;
+	struct json_context *ctx;
+	struct gzip_context *gzctx;
+	struct gzip_stream *gz;
+	struct json_chunk *chunk;
+	struct json *obj;
+	struct utf8lite_text *fields;
+	const char *name, *field;
+	uint8_t *buf;
+	size_t size, parsed, capacity, capacity2;
+	R_xlen_t nrow, nblock;
+	int err = 0, k, cur, nobj, type_id;
+
+	name = file_path(sfile);
+	nobj = (int)XLENGTH(sobjs);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), json_context_destroy));
+	ctx = as_context(sctx);
+
+	if (nobj > 0) {
+		TRY_ALLOC(ctx->chunks = corpus_calloc(nobj,
+						      sizeof(*ctx->chunks)));
+	}
+	ctx->nchunk = nobj;
+	fields = (struct utf8lite_text *)R_alloc(nobj + 1, sizeof(*fields));
+
+	for (k = 0; k < nobj; k++) {
+		chunk = &ctx->chunks[k];
+		TRY(corpus_schema_init(&chunk->schema));
+		chunk->has_schema = 1;
+		chunk->type_id = CORPUS_DATATYPE_NULL;
+
+		sfield = getListElement(VECTOR_ELT(sobjs, k), "field");
+		if (sfield != R_NilValue) {
+			field = CHAR(STRING_ELT(sfield, 0));
+			TRY(utf8lite_text_assign(&fields[k],
+						 (const uint8_t *)field,
+						 strlen(field), 0, NULL));
+			chunk->field = &fields[k];
+		}
+	}
+
+	PROTECT(sgz = alloc_context(sizeof(*gzctx), gzip_context_destroy));
+	gzctx = as_context(sgz);
+	gz = &gzctx->gz;
+
+	errno = 0;
+	if (gzip_stream_open(gz, name)) {
+		if (errno) {
+			error("cannot open file '%s': %s", name,
+			      strerror(errno));
+		} else {
+			error("cannot open file '%s'", name);
+		}
+	}
+	gzctx->has_gz = 1;
+
+	// allocate the buffer up front when the trailer gives its size
+	capacity = gzip_size_hint(name);
+	if (capacity > R_XLEN_T_MAX) {
+		capacity = 0;
+	}
+	PROTECT_WITH_INDEX(sbuffer = allocVector(RAWSXP, (R_xlen_t)capacity),
+			   &ipx);
+
+	size = 0;
+	parsed = 0;
+	cur = 0;
+	gzip_stream_read(gz, cur);
+
+	for (nblock = 0; gz->size[cur] > 0; nblock++) {
+		RCORPUS_CHECK_INTERRUPT(nblock);
+
+		if (gz->size[cur] > capacity - size) {
+			capacity2 = (capacity > (size_t)R_XLEN_T_MAX / 2
+					? (size_t)R_XLEN_T_MAX : 2 * capacity);
+			if (capacity2 < size + gz->size[cur]) {
+				capacity2 = size + gz->size[cur];
+			}
+			if (capacity2 > (size_t)R_XLEN_T_MAX) {
+				TRY(CORPUS_ERROR_OVERFLOW);
+			}
+
+			sbuffer2 = allocVector(RAWSXP, (R_xlen_t)capacity2);
+			if (size > 0) {
+				memcpy(RAW(sbuffer2), RAW(sbuffer), size);
+			}
+			for (k = 0; k < nobj; k++) {
+				json_chunk_rebase(&ctx->chunks[k],
+						  RAW(sbuffer), RAW(sbuffer2));
+			}
+			REPROTECT(sbuffer = sbuffer2, ipx);
+			capacity = capacity2;
+		}
+		buf = RAW(sbuffer);
+
+#ifdef _OPENMP
+		#pragma omp parallel sections num_threads(2)
+#endif
+		{
+#ifdef _OPENMP
+			#pragma omp section
+#endif
+			gzip_stream_read(gz, 1 - cur);
+#ifdef _OPENMP
+			#pragma omp section
+#endif
+			json_gzip_consume(ctx, buf, &size, &parsed,
+					  gz->block[cur], gz->size[cur]);
+		}
+
+		json_gzip_check(ctx);
+		if (gz->error) {
+			error("failed decompressing file '%s'", name);
+		}
+		cur = 1 - cur;
+	}
+
+	// the first read can fail before the loop starts
+	if (gz->error) {
+		error("failed decompressing file '%s'", name);
+	}
+
+	// parse the last line, if it doesn't end in a newline
+	if (parsed < size) {
+		buf = RAW(sbuffer);
+		for (k = 0; k < nobj; k++) {
+			chunk = &ctx->chunks[k];
+			chunk->begin = buf + parsed;
+			chunk->end = buf + size;
+			json_chunk_parse(chunk);
+		}
+		json_gzip_check(ctx);
+	}
+
+	free_context(sgz);
+
+	// the size hint is wrong for some files; trim the excess
+	if (size < capacity) {
+		sbuffer2 = allocVector(RAWSXP, (R_xlen_t)size);
+		if (size > 0) {
+			memcpy(RAW(sbuffer2), RAW(sbuffer), size);
+		}
+		for (k = 0; k < nobj; k++) {
+			json_chunk_rebase(&ctx->chunks[k], RAW(sbuffer),
+					  RAW(sbuffer2));
+		}
+		REPROTECT(sbuffer = sbuffer2, ipx);
+	}
+
+	for (k = 0; k < nobj; k++) {
+		chunk = &ctx->chunks[k];
+		sobj = VECTOR_ELT(sobjs, k);
+		obj = R_ExternalPtrAddr(getListElement(sobj, "handle"));
+
+		obj->rows = realloc_nonnull(obj->rows,
+					    chunk->nrow * sizeof(*obj->rows));
+		nrow = 0;
+		type_id = CORPUS_DATATYPE_NULL;
+		json_chunk_merge(ctx, chunk, obj, &nrow, &type_id);
+
+		obj->nrow = nrow;
+		obj->type_id = type_id;
+		obj->kind = (type_id < 0 ? CORPUS_DATATYPE_ANY
+				         : obj->schema.types[type_id].kind);
+
+		SET_VECTOR_ELT(sobj, findListElement(sobj, "buffer"), sbuffer);
+	}
+
+out:
+	CHECK_ERROR(err);
+	free_context(sctx);
+	UNPROTECT(3);
+	return sbuffer;
+}
+
+
+struct index_context {
+	struct ndjson_index index;
+	int has_index;
+};
+
+
+static void index_context_destroy(void *obj)
+{
+	struct index_context *ctx = obj;
+
+	if (ctx->has_index) {
+		ndjson_index_destroy(&ctx->index);
+	}
+}
+
+
+/*
+ * Parse only the given rows of an ndjson file, finding them with the
+ * line offsets stored in the file's index. Return zero, without loading
+ * anything, if the file doesn't have a valid index, or if one of the
+ * requested lines doesn't fall on the line boundaries; the caller then
+ * parses the whole file instead.
+ */
+static int json_load_index(struct json *parent,
+			   const struct corpus_filebuf *buf, SEXP srows,
+			   const struct utf8lite_text *field)
+{
+	SEXP sctx;
+	struct index_context *ctx;
+	const double *index;
+	const uint8_t *line;
+	char *name;
+	size_t len, line_size;
+	R_xlen_t i, n;
+	int err = 0, type_id;
+
+	len = strlen(buf->file_name);
+	name = R_alloc(len + sizeof(".index"), 1);
+	memcpy(name, buf->file_name, len);
+	memcpy(name + len, ".index", sizeof(".index"));
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), index_context_destroy));
+	ctx = as_context(sctx);
+
+	if (ndjson_index_init(&ctx->index, name, buf)) {
+		free_context(sctx);
+		UNPROTECT(1);
+		return 0;
+	}
+	ctx->has_index = 1;
+
+	index = REAL(srows);
+	n = XLENGTH(srows);
+
+	// check all of the lines before parsing any of them
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (!(1 <= index[i] && index[i] <= (double)ctx->index.nrow)) {
+			error("invalid index: %g", index[i]);
+		}
+
+		if (ndjson_index_line(&ctx->index, buf,
+				      (int64_t)(index[i] - 1), &line,
+				      &line_size)) {
+			free_context(sctx);
+			UNPROTECT(1);
+			return 0;
+		}
+	}
+
+	parent->rows = malloc_nonnull(n * sizeof(*parent->rows));
+	type_id = CORPUS_DATATYPE_NULL;
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		ndjson_index_line(&ctx->index, buf, (int64_t)(index[i] - 1),
+				  &line, &line_size);
+
+		if (field) {
+			TRY(json_assign_field(&parent->rows[i],
+					      &parent->schema, line,
+					      line_size, field));
+		} else {
+			TRY(corpus_data_assign(&parent->rows[i],
+					       &parent->schema, line,
+					       line_size));
+		}
+
+		TRY(corpus_schema_union(&parent->schema, type_id,
+					parent->rows[i].type_id, &type_id));
+	}
+
+	parent->nrow = n;
+	parent->type_id = type_id;
+	parent->kind = (type_id < 0 ? CORPUS_DATATYPE_ANY
+				    : parent->schema.types[type_id].kind);
+out:
+	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64" of JSON data",
+			   (uint64_t)index[i]);
+	free_context(sctx);
+	UNPROTECT(1);
+	return 1;
+}
+
+
+static void json_load(SEXP sdata, SEXP sthreads)
 {
 	SEXP shandle, sparent_handle, sbuffer, sfield, stext, sfield_path,
 	     srows, sparent, sparent2;
 	struct json *obj, *parent;
 	struct corpus_filebuf *buf;
-	struct corpus_filebuf_iter it;
-	const uint8_t *ptr, *begin, *line_end, *end;
-	uint_fast8_t ch;
-	size_t size;
+	struct line_iter it;
+	struct utf8lite_text name, *field;
+	const uint8_t *begin, *end;
+	const char *name_ptr;
 	R_xlen_t nrow, nrow_max, j, m;
-	int err = 0, type_id;
+	int err = 0, type_id, nthread;
 
 	shandle = getListElement(sdata, "handle");
 	obj = R_ExternalPtrAddr(shandle);
@@ -172,54 +1245,63 @@ static void json_load(SEXP sdata)
 
 	if (is_filebuf(sbuffer)) {
 		buf = as_filebuf(sbuffer);
-
-		corpus_filebuf_iter_make(&it, buf);
-		while (corpus_filebuf_iter_advance(&it)) {
-			RCORPUS_CHECK_INTERRUPT(nrow);
-
-			if (nrow == nrow_max) {
-				grow_datarows(&parent->rows, &nrow_max);
-			}
-
-			ptr = it.current.ptr;
-			size = it.current.size;
-
-			TRY(corpus_data_assign(&parent->rows[nrow],
-					       &parent->schema, ptr, size));
-
-			TRY(corpus_schema_union(&parent->schema, type_id,
-						parent->rows[nrow].type_id,
-						&type_id));
-			nrow++;
-		}
+		begin = buf->map_addr;
+		end = begin + buf->map_size;
 	} else {
-		// parse data from buffer
 		begin = (const uint8_t *)RAW(sbuffer);
 		end = begin + XLENGTH(sbuffer);
-		ptr = begin;
+	}
+	nthread = thread_count(sthreads, (R_xlen_t)(end - begin));
+
+	// if we only need one field, only type the values of that field
+	sfield_path = getListElement(sdata, "field");
+	if (sfield_path != R_NilValue && XLENGTH(sfield_path) > 0) {
+		name_ptr = CHAR(STRING_ELT(sfield_path, 0));
+		TRY(utf8lite_text_assign(&name, (const uint8_t *)name_ptr,
+					 strlen(name_ptr), 0, NULL));
+		field = &name;
+		m = XLENGTH(sfield_path);
+	} else {
+		field = NULL;
+		m = 0;
+	}
+
+	// if the file has an index, only parse the requested rows
+	srows = getListElement(sdata, "rows");
+	if (srows != R_NilValue && is_filebuf(sbuffer)
+			&& json_load_index(parent, as_filebuf(sbuffer), srows,
+					   field)) {
+		srows = R_NilValue;
+		goto path;
+	}
 
-		while (ptr != end) {
+	if (nthread > 1) {
+		json_load_parallel(parent, begin, end, field, nthread);
+		nrow = parent->nrow;
+		type_id = parent->type_id;
+	} else {
+		line_iter_make(&it, begin, end);
+		while (line_iter_advance(&it)) {
 			RCORPUS_CHECK_INTERRUPT(nrow);
 
 			if (nrow == nrow_max) {
 				grow_datarows(&parent->rows, &nrow_max);
 			}
 
-			line_end = ptr;
-			do {
-				ch = *line_end++;
-			} while (ch != '\n' && line_end != end);
-
-			size = (size_t)(line_end - ptr);
-
-			TRY(corpus_data_assign(&parent->rows[nrow],
-					       &parent->schema, ptr, size));
+			if (field) {
+				TRY(json_assign_field(&parent->rows[nrow],
+						      &parent->schema, it.ptr,
+						      it.size, field));
+			} else {
+				TRY(corpus_data_assign(&parent->rows[nrow],
+						       &parent->schema,
+						       it.ptr, it.size));
+			}
 
 			TRY(corpus_schema_union(&parent->schema, type_id,
 						parent->rows[nrow].type_id,
 						&type_id));
 			nrow++;
-			ptr = line_end;
 		}
 	}
 
@@ -234,7 +1316,6 @@ static void json_load(SEXP sdata)
 				    : parent->schema.types[type_id].kind);
 
 	// first extract the rows from the parent...
-	srows = getListElement(sdata, "rows");
 	if (srows != R_NilValue) {
 		PROTECT(sparent2 = subrows_json(sparent, srows));
 		free_json(sparent_handle);
@@ -243,18 +1324,15 @@ static void json_load(SEXP sdata)
 		sparent_handle = getListElement(sparent, "handle");
 	}
 
-	// ...then extract the field
-	sfield_path = getListElement(sdata, "field");
-	if (sfield_path != R_NilValue) {
-		m = XLENGTH(sfield_path);
-		for (j = 0; j < m; j++) {
-			sfield = STRING_ELT(sfield_path, j);
-			PROTECT(sparent2 = subfield_json(sparent, sfield));
-			free_json(sparent_handle);
-			UNPROTECT(2);
-			PROTECT(sparent = sparent2);
-			sparent_handle = getListElement(sparent, "handle");
-		}
+path:
+	// ...then extract the rest of the field path
+	for (j = 1; j < m; j++) {
+		sfield = STRING_ELT(sfield_path, j);
+		PROTECT(sparent2 = subfield_json(sparent, sfield));
+		free_json(sparent_handle);
+		UNPROTECT(2);
+		PROTECT(sparent = sparent2);
+		sparent_handle = getListElement(sparent, "handle");
 	}
 
 	// steal the handle from the parent
@@ -294,6 +1372,16 @@ int is_json(SEXP sdata)
 
 
 struct json *as_json(SEXP sdata)
+{
+	return as_json_threads(sdata, R_NilValue);
+}
+
+
+/*
+ * Like as_json, but if the data aren't loaded yet, parse the rows on
+ * 'threads' threads. The result is the same as for a serial parse.
+ */
+struct json *as_json_threads(SEXP sdata, SEXP sthreads)
 {
 	SEXP shandle;
 	struct json *obj;
@@ -302,7 +1390,7 @@ struct json *as_json(SEXP sdata)
 		error("invalid JSON object");
 	}
 
-	json_load(sdata);
+	json_load(sdata, sthreads);
 
 	shandle = getListElement(sdata, "handle");
 	obj = R_ExternalPtrAddr(shandle);
@@ -817,20 +1905,243 @@ static int in_string_set(SEXP strs, SEXP item)
 }
 
 
-static SEXP as_list_json_record(SEXP sdata)
+/*
+ * A column of a record. Fields with atomic values get decoded straight
+ * into an R vector; the others get copied into their own JSON object.
+ * Logical and numeric columns can get decoded on worker threads.
+ */
+struct json_column {
+	struct corpus_data *rows;
+	struct corpus_schema *schema;
+	void *values;
+	int type_id;
+	int kind;
+	int direct;
+	int parallel;
+	int overflow;
+};
+
+
+static SEXP alloc_column(struct json_column *col, R_xlen_t n)
+{
+	SEXP ans;
+	R_xlen_t i;
+	int *ival;
+	double *rval;
+
+	switch (col->kind) {
+	case CORPUS_DATATYPE_NULL:
+	case CORPUS_DATATYPE_BOOLEAN:
+		PROTECT(ans = allocVector(LGLSXP, n));
+		ival = LOGICAL(ans);
+		for (i = 0; i < n; i++) {
+			ival[i] = NA_LOGICAL;
+		}
+		col->values = ival;
+		break;
+
+	case CORPUS_DATATYPE_INTEGER:
+		PROTECT(ans = allocVector(INTSXP, n));
+		ival = INTEGER(ans);
+		for (i = 0; i < n; i++) {
+			ival[i] = NA_INTEGER;
+		}
+		col->values = ival;
+		break;
+
+	case CORPUS_DATATYPE_REAL:
+		PROTECT(ans = allocVector(REALSXP, n));
+		rval = REAL(ans);
+		for (i = 0; i < n; i++) {
+			rval[i] = NA_REAL;
+		}
+		col->values = rval;
+		break;
+
+	default:
+		assert(col->kind == CORPUS_DATATYPE_TEXT);
+		PROTECT(ans = allocVector(STRSXP, n));
+		for (i = 0; i < n; i++) {
+			SET_STRING_ELT(ans, i, NA_STRING);
+		}
+		col->values = NULL;
+		break;
+	}
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/*
+ * Widen an integer column to double when a value doesn't fit in an R
+ * integer, converting the values decoded so far.
+ */
+static SEXP promote_column(struct json_column *col, SEXP sval, R_xlen_t n)
+{
+	SEXP ans;
+	const int *ival = INTEGER(sval);
+	double *rval;
+	R_xlen_t i;
+
+	PROTECT(ans = allocVector(REALSXP, n));
+	rval = REAL(ans);
+	for (i = 0; i < n; i++) {
+		rval[i] = (ival[i] == NA_INTEGER) ? NA_REAL : (double)ival[i];
+	}
+	col->values = rval;
+	col->kind = CORPUS_DATATYPE_REAL;
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/*
+ * Decode the parallel columns for a block of rows. These columns don't
+ * allocate from the R heap, so this runs on a worker thread. An integer
+ * that overflows gets stored as NA, and its column gets flagged for
+ * promotion to double.
+ */
+static void json_columns_block(const struct json *d,
+			       const struct json_column *cols,
+			       const int *col_index, R_xlen_t begin,
+			       R_xlen_t end, struct decode *decode,
+			       int *overflow)
+{
+	struct corpus_data_fields it;
+	const struct json_column *col;
+	R_xlen_t i;
+	int j, old;
+
+	for (i = begin; i < end; i++) {
+		if (corpus_data_fields(&d->rows[i], &d->schema, &it)) {
+			// record is null
+			continue;
+		}
+
+		while (corpus_data_fields_advance(&it)) {
+			j = col_index[it.name_id];
+			col = &cols[j];
+			if (!col->parallel) {
+				continue;
+			}
+
+			switch (col->kind) {
+			case CORPUS_DATATYPE_BOOLEAN:
+				((int *)col->values)[i] =
+					decode_logical(decode, &it.current);
+				break;
+
+			case CORPUS_DATATYPE_INTEGER:
+				old = decode_set_overflow(decode, 0);
+				((int *)col->values)[i] =
+					decode_integer(decode, &it.current);
+				if (decode_set_overflow(decode, old)) {
+					overflow[j] = 1;
+				}
+				break;
+
+			case CORPUS_DATATYPE_REAL:
+				((double *)col->values)[i] =
+					decode_real(decode, &it.current);
+				break;
+
+			default:
+				break;
+			}
+		}
+	}
+}
+
+
+/*
+ * Decode the parallel columns on 'nthread' threads, each taking a
+ * contiguous block of rows.
+ */
+static void json_columns_parallel(const struct json *d,
+				  struct json_column *cols,
+				  const int *col_index, int nfield,
+				  int nthread, struct decode *decode)
+{
+	struct decode *decodes;
+	int *overflow;
+	R_xlen_t n = d->nrow;
+	int j, k;
+
+	decodes = (struct decode *)R_alloc(nthread, sizeof(*decodes));
+	overflow = (int *)R_alloc((size_t)nthread * nfield,
+				  sizeof(*overflow));
+
+	for (k = 0; k < nthread; k++) {
+		decode_init(&decodes[k]);
+		for (j = 0; j < nfield; j++) {
+			overflow[k * nfield + j] = 0;
+		}
+	}
+
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(nthread)
+#endif
+	for (k = 0; k < nthread; k++) {
+		json_columns_block(d, cols, col_index, k * n / nthread,
+				   (k + 1) * n / nthread, &decodes[k],
+				   &overflow[k * nfield]);
+	}
+
+	for (k = 0; k < nthread; k++) {
+		if (decodes[k].overflow) {
+			decode->overflow = 1;
+		}
+		if (decodes[k].underflow) {
+			decode->underflow = 1;
+		}
+		for (j = 0; j < nfield; j++) {
+			if (overflow[k * nfield + j]) {
+				cols[j].overflow = 1;
+			}
+		}
+	}
+}
+
+
+/*
+ * Fill in the values of a column that got promoted to double after a
+ * parallel decode. Only the rows left as NA need another look.
+ */
+static void json_column_refill(const struct json *d,
+			       const struct json_column *col, int name_id,
+			       struct decode *decode)
+{
+	struct corpus_data val;
+	double *rval = col->values;
+	R_xlen_t i, n = d->nrow;
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (ISNA(rval[i]) && !corpus_data_field(&d->rows[i],
+							&d->schema, name_id,
+							&val)) {
+			rval[i] = decode_real(decode, &val);
+		}
+	}
+}
+
+
+static SEXP as_list_json_record(SEXP sdata, SEXP sthreads)
 {
 	SEXP ans, ans_j, names, sbuffer, sfield, sfield2, srows, stext,
 	     shandle, sname;
 	const struct json *d = as_json(sdata);
 	struct json *d_j;
-	struct corpus_schema **schema;
+	struct json_column *col, *cols;
 	const struct corpus_datatype_record *r;
 	struct corpus_data_fields it;
+	struct decode decode;
 	R_xlen_t i, n = d->nrow, k, m;
-	int err = 0, j, nfield;
-	int *type_id;
-	struct corpus_data **rows;
-	int *cols;
+	int err = 0, j, nfield, field_type, overflow, nthread, nparallel;
+	int *col_index;
 
 	assert(d->kind == CORPUS_DATATYPE_RECORD);
 
@@ -845,17 +2156,55 @@ static SEXP as_list_json_record(SEXP sdata)
 
 	PROTECT(ans = allocVector(VECSXP, r->nfield));
 	setAttrib(ans, R_NamesSymbol, names);
-	rows = (struct corpus_data **)R_alloc(nfield, sizeof(*rows));
-	cols = (int *)R_alloc(d->schema.names.ntype, sizeof(*cols));
-	schema = (struct corpus_schema **)R_alloc(nfield, sizeof(*schema));
-	type_id = (int *)R_alloc(nfield, sizeof(type_id));
+	cols = (struct json_column *)R_alloc(nfield, sizeof(*cols));
+	col_index = (int *)R_alloc(d->schema.names.ntype, sizeof(*col_index));
+
+	decode_init(&decode);
+	nthread = thread_count(sthreads, n);
+	nparallel = 0;
 
 	for (j = 0; j < nfield; j++) {
 		RCORPUS_CHECK_INTERRUPT(j);
 
-		cols[r->name_ids[j]] = j;
-
+		col_index[r->name_ids[j]] = j;
+		col = &cols[j];
 		sname = STRING_ELT(names, j);
+
+		// the field's type is the union of its types over all rows
+		field_type = r->type_ids[j];
+		col->kind = (field_type < 0 ? CORPUS_DATATYPE_ANY
+				: d->schema.types[field_type].kind);
+
+		switch (col->kind) {
+		case CORPUS_DATATYPE_NULL:
+		case CORPUS_DATATYPE_BOOLEAN:
+		case CORPUS_DATATYPE_INTEGER:
+		case CORPUS_DATATYPE_REAL:
+			col->direct = 1;
+			break;
+
+		case CORPUS_DATATYPE_TEXT:
+			col->direct = !in_string_set(stext, sname);
+			break;
+
+		default:
+			col->direct = 0;
+			break;
+		}
+
+		// strings need CHARSXPs, so they stay on the main thread
+		col->parallel = (nthread > 1 && col->direct
+				 && col->kind != CORPUS_DATATYPE_TEXT);
+		col->overflow = 0;
+		nparallel += col->parallel;
+
+		if (col->direct) {
+			col->rows = NULL;
+			col->schema = NULL;
+			SET_VECTOR_ELT(ans, j, alloc_column(col, n));
+			continue;
+		}
+
 		m = (sfield == R_NilValue) ? 0 : XLENGTH(sfield);
 
 		PROTECT(sfield2 = allocVector(STRSXP, m + 1));
@@ -871,14 +2220,30 @@ static SEXP as_list_json_record(SEXP sdata)
 		d_j = R_ExternalPtrAddr(shandle);
 
 		// use calloc so that all items are initialized to null
-		rows[j] = calloc_nonnull(n, sizeof(*rows[j]));
-		d_j->rows = rows[j];
+		col->rows = calloc_nonnull(n, sizeof(*col->rows));
+		d_j->rows = col->rows;
 		d_j->nrow = n;
-		schema[j] = &d_j->schema;
-		type_id[j] = CORPUS_DATATYPE_NULL;
+		col->schema = &d_j->schema;
+		col->type_id = CORPUS_DATATYPE_NULL;
 	}
 
-	for (i = 0; i < n; i++) {
+	if (nparallel > 0) {
+		json_columns_parallel(d, cols, col_index, nfield, nthread,
+				      &decode);
+
+		for (j = 0; j < nfield; j++) {
+			col = &cols[j];
+			if (col->overflow) {
+				SET_VECTOR_ELT(ans, j, promote_column(col,
+					VECTOR_ELT(ans, j), n));
+				json_column_refill(d, col, r->name_ids[j],
+						   &decode);
+			}
+		}
+	}
+
+	// skip the serial pass if the threads decoded every column
+	for (i = 0; i < (nparallel < nfield ? n : 0); i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 
 		if ((err = corpus_data_fields(&d->rows[i], &d->schema, &it))) {
@@ -887,29 +2252,84 @@ static SEXP as_list_json_record(SEXP sdata)
 		}
 
 		while (corpus_data_fields_advance(&it)) {
-			j = cols[it.name_id];
-			TRY(corpus_data_assign(&rows[j][i], schema[j],
-					       it.current.ptr,
-					       it.current.size));
+			j = col_index[it.name_id];
+			col = &cols[j];
+			if (col->parallel) {
+				continue;
+			}
 
-			TRY(corpus_schema_union(schema[j], rows[j][i].type_id,
-						type_id[j], &type_id[j]));
+			switch (col->direct ? col->kind : CORPUS_DATATYPE_ANY) {
+			case CORPUS_DATATYPE_NULL:
+				break;
+
+			case CORPUS_DATATYPE_BOOLEAN:
+				((int *)col->values)[i] =
+					decode_logical(&decode, &it.current);
+				break;
+
+			case CORPUS_DATATYPE_INTEGER:
+				overflow = decode_set_overflow(&decode, 0);
+				((int *)col->values)[i] =
+					decode_integer(&decode, &it.current);
+				if (!decode_set_overflow(&decode, overflow)) {
+					break;
+				}
+				SET_VECTOR_ELT(ans, j, promote_column(col,
+					VECTOR_ELT(ans, j), n));
+				// else fall through to CORPUS_DATATYPE_REAL
+
+			case CORPUS_DATATYPE_REAL:
+				((double *)col->values)[i] =
+					decode_real(&decode, &it.current);
+				break;
+
+			case CORPUS_DATATYPE_TEXT:
+				SET_STRING_ELT(VECTOR_ELT(ans, j), i,
+					       decode_charsxp(&decode,
+							      &it.current));
+				break;
+
+			default:
+				TRY(corpus_data_assign(&col->rows[i],
+						       col->schema,
+						       it.current.ptr,
+						       it.current.size));
+
+				TRY(corpus_schema_union(col->schema,
+							col->rows[i].type_id,
+							col->type_id,
+							&col->type_id));
+				break;
+			}
 		}
 	}
 
 	for (j = 0; j < nfield; j++) {
+		col = &cols[j];
+		if (col->direct) {
+			continue;
+		}
+
 		ans_j = VECTOR_ELT(ans, j);
 		shandle = getListElement(ans_j, "handle");
 		d_j = R_ExternalPtrAddr(shandle);
-		d_j->type_id = type_id[j];
-		d_j->kind = ((type_id[j] < 0)
+		d_j->type_id = col->type_id;
+		d_j->kind = ((col->type_id < 0)
 				? CORPUS_DATATYPE_ANY
-				: schema[j]->types[type_id[j]].kind);
+				: col->schema->types[col->type_id].kind);
 
 		ans_j = simplify_json(ans_j);
 		SET_VECTOR_ELT(ans, j, ans_j);
 	}
 
+	if (decode.overflow) {
+		warning("Inf introduced by coercion to double-precision range");
+	}
+
+	if (decode.underflow) {
+		warning("0 introduced by coercion to double-precision range");
+	}
+
 	err = 0;
 out:
 	CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64
@@ -920,7 +2340,7 @@ out:
 }
 
 
-SEXP as_list_json(SEXP sdata)
+SEXP as_list_json(SEXP sdata, SEXP sthreads)
 {
 	SEXP ans, val;
 	const struct json *d = as_json(sdata);
@@ -929,7 +2349,7 @@ SEXP as_list_json(SEXP sdata)
 	R_xlen_t i, n = d->nrow;
 
 	if (d->kind == CORPUS_DATATYPE_RECORD) {
-		return as_list_json_record(sdata);
+		return as_list_json_record(sdata, sthreads);
 	}
 
 	PROTECT(ans = allocVector(VECSXP, n));
@@ -1007,7 +2427,7 @@ SEXP simplify_json(SEXP sdata)
 		break;
 
 	default:
-		ans = as_list_json(sdata);
+		ans = as_list_json(sdata, R_NilValue);
 		break;
 	}
 
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rcorpus.h"
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+/*
+ * Find the lines in a buffer of newline-delimited JSON. A JSON string
+ * can't contain a raw newline, so every newline byte ends a row, and the
+ * scan doesn't need to track quotes or escapes.
+ *
+ * The buffer gets scanned in 64-byte blocks, each reduced to a bit mask
+ * of its newline positions, with SIMD compares where available. The line
+ * ends come from popping bits off the mask, so each byte gets looked at
+ * once, no matter how long or short the lines are.
+ */
+
+#define LINE_BLOCK 64
+
+
+static uint64_t newline_mask(const uint8_t *ptr)
+{
+#if defined(__AVX2__)
+	const __m256i nl = _mm256_set1_epi8('\n');
+	__m256i lo = _mm256_loadu_si256((const __m256i *)ptr);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(ptr + 32));
+	uint64_t mlo = (uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(lo, nl));
+	uint64_t mhi = (uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(hi, nl));
+	return mlo | (mhi << 32);
+#elif defined(__SSE2__)
+	const __m128i nl = _mm_set1_epi8('\n');
+	__m128i v;
+	uint64_t mask = 0;
+	int k;
+
+	for (k = 0; k < 4; k++) {
+		v = _mm_loadu_si128((const __m128i *)(ptr + 16 * k));
+		mask |= ((uint64_t)(uint16_t)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(v, nl))) << (16 * k);
+	}
+	return mask;
+#else
+	uint64_t mask = 0;
+	int k;
+
+	for (k = 0; k < LINE_BLOCK; k++) {
+		mask |= ((uint64_t)(ptr[k] == '\n')) << k;
+	}
+	return mask;
+#endif
+}
+
+
+static uint64_t newline_mask_tail(const uint8_t *ptr, size_t size)
+{
+	uint64_t mask = 0;
+	size_t k;
+
+	for (k = 0; k < size; k++) {
+		mask |= ((uint64_t)(ptr[k] == '\n')) << k;
+	}
+	return mask;
+}
+
+
+static int lowest_bit(uint64_t mask)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(mask);
+#else
+	int bit = 0;
+
+	while (!(mask & 1)) {
+		mask >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+
+void line_iter_make(struct line_iter *it, const uint8_t *begin,
+		    const uint8_t *end)
+{
+	it->block = begin;
+	it->scanned = begin;
+	it->next = begin;
+	it->end = end;
+	it->mask = 0;
+	it->ptr = NULL;
+	it->size = 0;
+}
+
+
+/*
+ * Advance to the next line. The line includes its trailing newline, if
+ * it has one; the last line need not.
+ */
+int line_iter_advance(struct line_iter *it)
+{
+	const uint8_t *begin = it->next;
+	const uint8_t *line_end;
+	size_t rest;
+
+	if (begin == it->end) {
+		it->ptr = it->end;
+		it->size = 0;
+		return 0;
+	}
+
+	while (!it->mask) {
+		if (it->scanned == it->end) {
+			line_end = it->end;
+			goto out;
+		}
+
+		it->block = it->scanned;
+		rest = (size_t)(it->end - it->block);
+		if (rest >= LINE_BLOCK) {
+			it->mask = newline_mask(it->block);
+			it->scanned = it->block + LINE_BLOCK;
+		} else {
+			it->mask = newline_mask_tail(it->block, rest);
+			it->scanned = it->end;
+		}
+	}
+
+	line_end = it->block + lowest_bit(it->mask) + 1;
+	it->mask &= it->mask - 1;
+
+out:
+	it->ptr = begin;
+	it->size = (size_t)(line_end - begin);
+	it->next = line_end;
+	return 1;
+}
+
+
+/* Find the start of the line after the one containing 'ptr' */
+const uint8_t *line_next(const uint8_t *ptr, const uint8_t *end)
+{
+	uint64_t mask;
+	size_t rest;
+
+	while ((rest = (size_t)(end - ptr)) >= LINE_BLOCK) {
+		if ((mask = newline_mask(ptr))) {
+			return ptr + lowest_bit(mask) + 1;
+		}
+		ptr += LINE_BLOCK;
+	}
+
+	if ((mask = newline_mask_tail(ptr, rest))) {
+		return ptr + lowest_bit(mask) + 1;
+	}
+	return end;
+}
@@ -18,28 +18,104 @@
 #include "rcorpus.h"
 
 
-SEXP mmap_ndjson(SEXP sfile, SEXP stext)
+/*
+ * Load the data in a buffer. If 'fields' is non-NULL, return a list with
+ * one JSON object for each field, each loaded without typing the values
+ * of the other fields. If 'rows' is non-NULL, only load those rows.
+ */
+static SEXP load_ndjson(SEXP sbuffer, SEXP stext, SEXP sthreads,
+			SEXP sfields, SEXP srows)
+{
+	SEXP ans, elt, spath;
+	R_xlen_t i, n;
+
+	if (sfields == R_NilValue) {
+		PROTECT(ans = alloc_json(sbuffer, R_NilValue, srows, stext));
+		as_json_threads(ans, sthreads); // force data load
+		UNPROTECT(1);
+		return ans;
+	}
+
+	n = XLENGTH(sfields);
+	PROTECT(ans = allocVector(VECSXP, n));
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		PROTECT(spath = ScalarString(STRING_ELT(sfields, i)));
+		PROTECT(elt = alloc_json(sbuffer, spath, srows, stext));
+		SET_VECTOR_ELT(ans, i, elt);
+		UNPROTECT(2);
+
+		as_json_threads(elt, sthreads); // force data load
+	}
+
+	setAttrib(ans, R_NamesSymbol, sfields);
+	UNPROTECT(1);
+	return ans;
+}
+
+
+SEXP mmap_ndjson(SEXP sfile, SEXP stext, SEXP sthreads, SEXP sfields,
+		 SEXP srows)
 {
 	SEXP ans, sbuf;
 
 	PROTECT(sbuf = alloc_filebuf(sfile));
-	PROTECT(ans = alloc_json(sbuf, R_NilValue, R_NilValue, stext));
-	as_json(ans); // force data load
-	UNPROTECT(2);
+	ans = load_ndjson(sbuf, stext, sthreads, sfields, srows);
+	UNPROTECT(1);
 
 	return ans;
 }
 
 
-SEXP read_ndjson(SEXP sbuffer, SEXP stext)
+SEXP read_ndjson(SEXP sbuffer, SEXP stext, SEXP sthreads, SEXP sfields)
 {
-	SEXP ans;
-
 	assert(TYPEOF(sbuffer) == RAWSXP);
 
-	PROTECT(ans = alloc_json(sbuffer, R_NilValue, R_NilValue, stext));
-	as_json(ans); // force data load
-	UNPROTECT(1);
+	return load_ndjson(sbuffer, stext, sthreads, sfields, R_NilValue);
+}
+
+
+/*
+ * Load the data in a gzip-compressed file. With one thread, parse the
+ * lines while the rest of the file gets decompressed; with more, parse
+ * the decompressed data in parallel afterward.
+ */
+SEXP read_ndjson_gzip(SEXP sfile, SEXP stext, SEXP sthreads, SEXP sfields)
+{
+	SEXP ans, elt, sbuffer, sobjs, spath;
+	R_xlen_t i, n;
+
+	if (thread_count(sthreads, 2) > 1) {
+		PROTECT(sobjs = allocVector(VECSXP, 0));
+		PROTECT(sbuffer = json_load_gzip(sfile, sobjs));
+		ans = load_ndjson(sbuffer, stext, sthreads, sfields,
+				  R_NilValue);
+		UNPROTECT(2);
+		return ans;
+	}
 
+	if (sfields == R_NilValue) {
+		PROTECT(ans = alloc_json(R_NilValue, R_NilValue, R_NilValue,
+					 stext));
+		PROTECT(sobjs = allocVector(VECSXP, 1));
+		SET_VECTOR_ELT(sobjs, 0, ans);
+	} else {
+		n = XLENGTH(sfields);
+		PROTECT(ans = allocVector(VECSXP, n));
+		for (i = 0; i < n; i++) {
+			PROTECT(spath = ScalarString(STRING_ELT(sfields, i)));
+			elt = alloc_json(R_NilValue, spath, R_NilValue, stext);
+			SET_VECTOR_ELT(ans, i, elt);
+			UNPROTECT(1);
+		}
+		setAttrib(ans, R_NamesSymbol, sfields);
+		PROTECT(sobjs = ans);
+	}
+
+	json_load_gzip(sfile, sobjs);
+
+	UNPROTECT(2);
 	return ans;
 }
@@ -0,0 +1,252 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "rcorpus.h"
+
+/*
+ * An ndjson index file stores the byte offset of each line in an ndjson
+ * file, so that reading a few rows doesn't need a scan of the whole file.
+ * In native byte order:
+ *
+ *     header: char magic[8], int64 nrow, int64 data_size,
+ *             uint64 checksum
+ *     offset: uint64 offset[nrow]
+ *
+ * Line 'i' spans from offset[i] to offset[i + 1], or to the end of the
+ * data for the last line. The 'data_size' is the size of the ndjson file
+ * when the index got written, and the 'checksum' is a hash of its first
+ * and last 4 KB; an index whose size or checksum doesn't match is out of
+ * date. Reading a line also checks that it starts and ends at line
+ * boundaries, to catch other changes to the file.
+ */
+
+#define NDJSON_INDEX_MAGIC "corpusNI"
+#define NDJSON_INDEX_HEADER_SIZE (8 + 3 * sizeof(int64_t))
+#define NDJSON_INDEX_CHECK_SIZE 4096
+
+
+/*
+ * Hash the start and end of the data with 64-bit FNV-1a. This is cheap
+ * for any file size, and catches most edits that keep the size the same.
+ */
+static uint64_t ndjson_index_checksum(const struct corpus_filebuf *data)
+{
+	const uint8_t *ptr = data->map_addr;
+	size_t size = data->map_size;
+	size_t head, tail, i;
+	uint64_t hash = UINT64_C(14695981039346656037);
+
+	head = size < NDJSON_INDEX_CHECK_SIZE ? size : NDJSON_INDEX_CHECK_SIZE;
+	tail = size - head < NDJSON_INDEX_CHECK_SIZE
+		? size - head : NDJSON_INDEX_CHECK_SIZE;
+
+	for (i = 0; i < head; i++) {
+		hash = (hash ^ ptr[i]) * UINT64_C(1099511628211);
+	}
+	for (i = size - tail; i < size; i++) {
+		hash = (hash ^ ptr[i]) * UINT64_C(1099511628211);
+	}
+
+	return hash;
+}
+
+
+int ndjson_index_init(struct ndjson_index *index, const char *name,
+		      const struct corpus_filebuf *data)
+{
+	const uint8_t *ptr;
+	size_t size;
+	uint64_t checksum;
+
+	if (corpus_filebuf_init(&index->buf, name)) {
+		return CORPUS_ERROR_INVAL;
+	}
+
+	ptr = index->buf.map_addr;
+	size = index->buf.map_size;
+
+	if (size < NDJSON_INDEX_HEADER_SIZE
+			|| memcmp(ptr, NDJSON_INDEX_MAGIC, 8) != 0) {
+		goto invalid;
+	}
+	ptr += 8;
+
+	memcpy(&index->nrow, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&index->data_size, ptr, sizeof(int64_t));
+	ptr += sizeof(int64_t);
+	memcpy(&checksum, ptr, sizeof(uint64_t));
+	ptr += sizeof(uint64_t);
+
+	size -= NDJSON_INDEX_HEADER_SIZE;
+	if (index->nrow < 0 || (uint64_t)index->nrow
+				> size / sizeof(uint64_t)
+			|| index->data_size < 0
+			|| (uint64_t)index->data_size
+				!= (uint64_t)data->map_size
+			|| checksum != ndjson_index_checksum(data)) {
+		goto invalid;
+	}
+
+	index->offset = ptr;
+	return 0;
+
+invalid:
+	corpus_filebuf_destroy(&index->buf);
+	return CORPUS_ERROR_INVAL;
+}
+
+
+void ndjson_index_destroy(struct ndjson_index *index)
+{
+	corpus_filebuf_destroy(&index->buf);
+}
+
+
+int ndjson_index_line(const struct ndjson_index *index,
+		      const struct corpus_filebuf *data, int64_t i,
+		      const uint8_t **ptrptr, size_t *sizeptr)
+{
+	const uint8_t *base = data->map_addr;
+	uint64_t begin, end, size = (uint64_t)index->data_size;
+
+	memcpy(&begin, index->offset + i * sizeof(uint64_t), sizeof(begin));
+	if (i + 1 < index->nrow) {
+		memcpy(&end, index->offset + (i + 1) * sizeof(uint64_t),
+		       sizeof(end));
+	} else {
+		end = size;
+	}
+
+	if (begin >= end || end > size
+			|| (begin > 0 && base[begin - 1] != '\n')
+			|| (end < size && base[end - 1] != '\n')) {
+		return CORPUS_ERROR_INVAL;
+	}
+
+	*ptrptr = base + begin;
+	*sizeptr = (size_t)(end - begin);
+	return 0;
+}
+
+
+SEXP ndjson_index_valid(SEXP sfile, SEXP sindex)
+{
+	SEXP sbuf;
+	struct ndjson_index index;
+	const char *name;
+	int valid;
+
+	PROTECT(sbuf = alloc_filebuf(sfile));
+	name = file_path(sindex);
+
+	if (ndjson_index_init(&index, name, as_filebuf(sbuf)) == 0) {
+		ndjson_index_destroy(&index);
+		valid = TRUE;
+	} else {
+		valid = FALSE;
+	}
+
+	UNPROTECT(1);
+	return ScalarLogical(valid);
+}
+
+
+struct context {
+	FILE *file;
+	const char *file_name;
+};
+
+
+static void context_destroy(void *obj)
+{
+	struct context *ctx = obj;
+
+	if (ctx->file) {
+		fclose(ctx->file);
+	}
+}
+
+
+static void context_write_header(struct context *ctx, int64_t nrow,
+				 int64_t data_size, uint64_t checksum)
+{
+	FILE *file = ctx->file;
+	const char *name = ctx->file_name;
+
+	if (fseek(file, 0, SEEK_SET) != 0) {
+		error("failed writing to file '%s'", name);
+	}
+
+	write_file(file, name, NDJSON_INDEX_MAGIC, 1, 8);
+	write_file(file, name, &nrow, sizeof(nrow), 1);
+	write_file(file, name, &data_size, sizeof(data_size), 1);
+	write_file(file, name, &checksum, sizeof(checksum), 1);
+}
+
+
+SEXP write_ndjson_index(SEXP sfile, SEXP sindex)
+{
+	SEXP sbuf, sctx;
+	struct context *ctx;
+	const struct corpus_filebuf *buf;
+	const uint8_t *begin;
+	struct line_iter it;
+	uint64_t offset, checksum;
+	int64_t nrow, data_size;
+	int nprot = 0;
+
+	PROTECT(sbuf = alloc_filebuf(sfile)); nprot++;
+	buf = as_filebuf(sbuf);
+	begin = buf->map_addr;
+	data_size = (int64_t)buf->map_size;
+	checksum = ndjson_index_checksum(buf);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+	ctx = as_context(sctx);
+
+	ctx->file_name = file_path(sindex);
+	ctx->file = open_file(ctx->file_name);
+
+	// leave room for the header; it gets written at the end
+	context_write_header(ctx, 0, data_size, checksum);
+
+	nrow = 0;
+	line_iter_make(&it, begin, begin + buf->map_size);
+	while (line_iter_advance(&it)) {
+		RCORPUS_CHECK_INTERRUPT(nrow);
+		offset = (uint64_t)(it.ptr - begin);
+		write_file(ctx->file, ctx->file_name, &offset, sizeof(offset),
+			   1);
+		nrow++;
+	}
+
+	context_write_header(ctx, nrow, data_size, checksum);
+
+	if (fclose(ctx->file) != 0) {
+		ctx->file = NULL;
+		error("failed writing to file '%s'", ctx->file_name);
+	}
+	ctx->file = NULL;
+
+	free_context(sctx);
+	UNPROTECT(nprot);
+	return R_NilValue;
+}
@@ -19,8 +19,19 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <Rdefines.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+
+// lazy character vectors need ALTREP, added in R 3.5.0
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 5, 0)
+#define RCORPUS_ALTREP 1
+#endif
 
 #include "corpus/lib/utf8lite/src/utf8lite.h"
 #include "corpus/src/array.h"
@@ -116,6 +127,23 @@ struct corpus_filter;
 struct corpus_search;
 struct corpus_sentfilter;
 
+struct line_iter {
+	const uint8_t *block;
+	const uint8_t *scanned;
+	const uint8_t *next;
+	const uint8_t *end;
+	uint64_t mask;
+	const uint8_t *ptr;
+	size_t size;
+};
+
+struct gzip_stream {
+	void *file;
+	uint8_t *block[2];
+	size_t size[2];
+	int error;
+};
+
 struct mkchar {
 	uint8_t *buf;
 	int size;
@@ -137,37 +165,124 @@ struct json {
 
 enum stemmer_type {
 	STEMMER_NONE = 0,
+	STEMMER_DICT,
 	STEMMER_RFUNC,
 	STEMMER_SNOWBALL,
 };
 
+struct stem_dict {
+	struct corpus_table table;
+	struct utf8lite_text *terms;
+	struct utf8lite_text *stems;
+	struct utf8lite_text default_stem;
+	int has_default;
+	int nterm;
+};
+
 struct stemmer_rfunc {
 	SEXP fn;
 	SEXP rho;
+	int vectorized;
+};
+
+struct stem_cache_item {
+	struct utf8lite_text type;
+	struct utf8lite_text stem;
+	int owned;
+};
+
+struct stem_cache {
+	struct corpus_table table;
+	struct stem_cache_item *items;
+	int nitem;
+	int nitem_max;
+};
+
+struct stem_pool {
+	struct stem_cache cache;
+	struct stemmer **stemmer;
+	int nstemmer;
+	int nstemmer_max;
+#ifdef _OPENMP
+	omp_lock_t lock;
+#endif
 };
 
 struct stemmer {
 	union {
+		const struct stem_dict *dict;
 		struct stemmer_rfunc rfunc;
 		struct corpus_stem_snowball snowball;
 	} value;
+	struct stem_cache cache;
+	struct stem_pool *pool;
+	const char *name;
 	int type;
 	corpus_stem_func stem_func;
 	void *stem_context;
+	corpus_stem_func base_func;
+	void *base_context;
+	int has_cache;
 	int error;
 };
 
-struct rcorpus_text {
-	struct utf8lite_text *text;
+struct filter_file {
+	struct corpus_filebuf buf;
+	struct utf8lite_text stemmer;
+	const uint8_t *settings;
+	const uint8_t *types;
+	const uint8_t *stems;
+	int64_t settings_size;
+	int64_t ntype;
+	int64_t types_size;
+	int64_t nstem;
+};
+
+struct corpus_file {
+	const struct corpus_filebuf *buf;
+	const uint8_t *meta;
+	const uint8_t *data;
+	const uint8_t *attr;
+	const uint8_t *offset;
+	int64_t nrow;
+	int64_t meta_size;
+	int64_t data_size;
+};
+
+struct ndjson_index {
+	struct corpus_filebuf buf;
+	const uint8_t *offset;
+	int64_t nrow;
+	int64_t data_size;
+};
+
+struct rcorpus_filter {
 	struct corpus_filter filter;
-	struct corpus_sentfilter sentfilter;
 	struct stemmer stemmer;
-	R_xlen_t length;
+	struct filter_file file;
 	int has_filter;
 	int valid_filter;
+	int has_stemmer;
+	int has_file;
+	int stemmer_gen;
+};
+
+struct rcorpus_text {
+	struct utf8lite_text *text;
+	struct corpus_sentfilter sentfilter;
+	R_xlen_t length;
 	int has_sentfilter;
 	int valid_sentfilter;
+	int batched_gen;
+};
+
+struct text_filter_copy {
+	struct corpus_filter filter;
+	struct stemmer stemmer;
+	struct filter_file file;
+	int has_filter;
 	int has_stemmer;
+	int has_file;
 };
 
 struct termset {
@@ -204,25 +319,59 @@ SEXP decode_sexp(struct decode *d, const struct corpus_data *val,
 void stemmer_init_none(struct stemmer *s);
 void stemmer_init_snowball(struct stemmer *s, const char *algorithm);
 void stemmer_init_rfunc(struct stemmer *s, SEXP fn, SEXP rho);
+void stemmer_init_dict(struct stemmer *s, SEXP dict);
 void stemmer_destroy(struct stemmer *s);
+void stemmer_keep_stems(struct stemmer *s);
+int stemmer_cache(struct stemmer *s, const struct utf8lite_text *type,
+		  const struct utf8lite_text *stem, int copy);
+void stemmer_batch(struct stemmer *s, const struct corpus_symtab_type *types,
+		   int ntype);
+int stemmer_batched(const struct stemmer *s);
+int stem_pool_init(struct stem_pool *pool, int nstemmer_max);
+void stem_pool_destroy(struct stem_pool *pool);
+void stem_pool_add(struct stem_pool *pool, struct stemmer *s);
+void stem_pool_attach(struct stem_pool *pool);
+void stem_pool_detach(struct stem_pool *pool);
 const char *stemmer_snowball_name(const char *alias);
 
-SEXP stem_snowball(SEXP x, SEXP algorithm);
+SEXP stem_snowball(SEXP x, SEXP algorithm, SEXP threads);
+
+SEXP alloc_stem_dict(SEXP term, SEXP stem, SEXP default_stem);
+int is_stem_dict(SEXP dict);
+const struct stem_dict *as_stem_dict(SEXP dict);
+SEXP stem_dict(SEXP dict, SEXP x);
+
 
+/* lines */
+void line_iter_make(struct line_iter *it, const uint8_t *begin,
+		    const uint8_t *end);
+int line_iter_advance(struct line_iter *it);
+const uint8_t *line_next(const uint8_t *ptr, const uint8_t *end);
 
 /* logging */
 SEXP logging_off(void);
 SEXP logging_on(void);
 
+/* gzip */
+int gzip_stream_open(struct gzip_stream *gz, const char *name);
+void gzip_stream_close(struct gzip_stream *gz);
+void gzip_stream_read(struct gzip_stream *gz, int k);
+size_t gzip_size_hint(const char *name);
+
 /* json */
 SEXP alloc_json(SEXP buffer, SEXP field, SEXP rows, SEXP text);
 int is_json(SEXP data);
 struct json *as_json(SEXP data);
+struct json *as_json_threads(SEXP data, SEXP threads);
+SEXP json_load_gzip(SEXP file, SEXP objs);
+int json_field_text(const uint8_t *line, size_t line_size,
+		    const struct utf8lite_text *field,
+		    struct utf8lite_text *text);
 
 SEXP as_integer_json(SEXP data);
 SEXP as_double_json(SEXP data);
 SEXP as_factor_json(SEXP data);
-SEXP as_list_json(SEXP data);
+SEXP as_list_json(SEXP data, SEXP threads);
 SEXP as_logical_json(SEXP data);
 SEXP as_character_json(SEXP data);
 SEXP as_text_json(SEXP data, SEXP filter);
@@ -234,6 +383,29 @@ SEXP simplify_json(SEXP data);
 SEXP subscript_json(SEXP data, SEXP i);
 SEXP subset_json(SEXP data, SEXP i, SEXP j);
 
+/* corpus file */
+int corpus_file_init(struct corpus_file *file,
+		     const struct corpus_filebuf *buf);
+int corpus_file_text(const struct corpus_file *file, int64_t i,
+		     struct utf8lite_text *text);
+SEXP corpus_file_meta(SEXP file);
+SEXP corpus_file_read(SEXP file, SEXP names, SEXP filter, SEXP validate);
+int is_corpus_file_table(SEXP table, SEXP buf);
+#ifdef RCORPUS_ALTREP
+void init_corpus_file_altrep(DllInfo *dll);
+#endif
+SEXP corpus_file_write(SEXP x, SEXP meta, SEXP file);
+
+/* ndjson index */
+int ndjson_index_init(struct ndjson_index *index, const char *name,
+		      const struct corpus_filebuf *data);
+void ndjson_index_destroy(struct ndjson_index *index);
+int ndjson_index_line(const struct ndjson_index *index,
+		      const struct corpus_filebuf *data, int64_t i,
+		      const uint8_t **ptrptr, size_t *sizeptr);
+SEXP ndjson_index_valid(SEXP file, SEXP index);
+SEXP write_ndjson_index(SEXP file, SEXP index);
+
 /* data */
 SEXP scalar_data(const struct corpus_data *d, const struct corpus_schema *s,
 		 int *overflowptr);
@@ -252,20 +424,45 @@ struct corpus_filter *text_filter(SEXP x);
 struct corpus_sentfilter *text_sentfilter(SEXP x);
 SEXP as_text_character(SEXP text, SEXP filter);
 
-SEXP alloc_text_handle(void);
+SEXP alloc_text_handle(SEXP share);
 SEXP coerce_text(SEXP x);
 SEXP length_text(SEXP text);
 SEXP names_text(SEXP text);
 SEXP filter_text(SEXP text);
 SEXP as_character_text(SEXP text);
+SEXP strings_text(SEXP text);
+#ifdef RCORPUS_ALTREP
+void init_text_altrep(DllInfo *dll);
+SEXP alloc_text_altrep(SEXP text);
+#endif
 SEXP is_na_text(SEXP text);
 SEXP anyNA_text(SEXP text);
 SEXP text_c(SEXP args, SEXP names, SEXP filter);
 SEXP text_trunc(SEXP x, SEXP chars, SEXP right);
 SEXP text_valid(SEXP x);
+SEXP make_ragged(SEXP values, SEXP offsets, SEXP names);
 
 /* text filter */
+SEXP alloc_filter_handle(void);
+SEXP text_filter_handle(SEXP handle);
+struct stemmer *text_stemmer(SEXP x);
 SEXP as_text_filter_connector(SEXP value);
+int text_filter_threadsafe(SEXP x);
+void text_filter_copy_init(struct text_filter_copy *copy, SEXP x);
+void text_filter_copy_destroy(struct text_filter_copy *copy);
+SEXP alloc_stem_batch(SEXP x);
+void stem_batch_add(SEXP batch, const struct utf8lite_text *text,
+		    R_xlen_t n);
+
+/* text filter file */
+void filter_file_init(struct filter_file *file, SEXP name);
+void filter_file_destroy(struct filter_file *file);
+void filter_file_load_stems(const struct filter_file *file,
+			    struct stemmer *s, SEXP filter);
+void filter_file_load_types(const struct filter_file *file,
+			    struct corpus_filter *f);
+SEXP read_text_filter(SEXP file);
+SEXP write_text_filter(SEXP x, SEXP settings, SEXP file);
 
 /* search */
 SEXP alloc_search(SEXP sterms, const char *name, struct corpus_filter *filter);
@@ -279,12 +476,24 @@ SEXP alloc_termset(SEXP sterms, const char *name,
 int is_termset(SEXP termset);
 struct termset *as_termset(SEXP termset);
 SEXP items_termset(SEXP termset);
+int termset_merge(struct corpus_termset *set, struct corpus_symtab *symtab,
+		  const struct corpus_termset *src,
+		  const struct corpus_symtab *src_symtab, int *term_map);
 
 /* text processing */
 SEXP abbreviations(SEXP kind);
 SEXP term_stats(SEXP x, SEXP ngrams, SEXP min_count, SEXP max_count,
-		SEXP min_support, SEXP max_support, SEXP output_types);
-SEXP term_matrix(SEXP x, SEXP ngrams, SEXP select, SEXP group);
+		SEXP min_support, SEXP max_support, SEXP output_types,
+		SEXP integer, SEXP threads);
+SEXP term_stats_ndjson(SEXP file, SEXP field, SEXP x, SEXP ngrams,
+		       SEXP min_count, SEXP max_count, SEXP min_support,
+		       SEXP max_support, SEXP output_types, SEXP integer);
+SEXP term_matrix(SEXP x, SEXP ngrams, SEXP select, SEXP group,
+		 SEXP integer, SEXP threads, SEXP compress, SEXP transpose);
+SEXP read_term_matrix(SEXP file, SEXP col_names, SEXP row_names,
+		      SEXP transpose);
+SEXP write_term_matrix(SEXP x, SEXP ngrams, SEXP select, SEXP group,
+		       SEXP file, SEXP terms_file);
 SEXP text_count(SEXP x, SEXP terms);
 SEXP text_detect(SEXP x, SEXP terms);
 SEXP text_locate(SEXP x, SEXP terms);
@@ -292,21 +501,33 @@ SEXP text_match(SEXP x, SEXP terms);
 SEXP text_nsentence(SEXP x);
 SEXP text_ntoken(SEXP x);
 SEXP text_ntype(SEXP x, SEXP collapse);
-SEXP text_split_sentences(SEXP x, SEXP size);
-SEXP text_split_tokens(SEXP x, SEXP size);
+SEXP text_split_sentences(SEXP x, SEXP size, SEXP ragged);
+SEXP text_split_tokens(SEXP x, SEXP size, SEXP ragged);
 SEXP text_sub(SEXP x, SEXP start, SEXP end);
+SEXP text_token_ids(SEXP x);
 SEXP text_tokens(SEXP x);
+SEXP text_tokens_ragged(SEXP x, SEXP ids);
 SEXP text_types(SEXP x, SEXP collapse);
 SEXP stopwords(SEXP kind);
 
 /* json values */
-SEXP mmap_ndjson(SEXP file, SEXP text);
-SEXP read_ndjson(SEXP buffer, SEXP text);
+SEXP mmap_ndjson(SEXP file, SEXP text, SEXP threads, SEXP fields,
+		 SEXP rows);
+SEXP read_ndjson(SEXP buffer, SEXP text, SEXP threads, SEXP fields);
+SEXP read_ndjson_gzip(SEXP file, SEXP text, SEXP threads, SEXP fields);
 
 /* internal utility functions */
 double *as_weights(SEXP sweights, R_xlen_t n);
 int encodes_utf8(cetype_t ce);
+const char *file_path(SEXP file);
 int findListElement(SEXP list, const char *str);
 SEXP getListElement(SEXP list, const char *str);
+FILE *open_file(const char *name);
+SEXP sort_names(SEXP names, int **mapptr);
+int thread_count(SEXP threads, R_xlen_t nitem);
+void transpose_csc(int nrow, int ncol, const int *colptr, const int *row,
+		   const double *val, int *tcolptr, int *trow, double *tval);
+void write_file(FILE *file, const char *name, const void *ptr, size_t size,
+		size_t count);
 
 #endif /* RCORPUS_H */
@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -65,11 +66,420 @@ const char *stemmer_snowball_name(const char *alias)
 }
 
 
+/*
+ * The stem cache remembers the stem of every type passed to the stemmer,
+ * so that a compiled filter can get saved and loaded without re-stemming.
+ * Only the stemmer of a compiled filter keeps one; the copies that
+ * parallel workers use share a pool instead. Items loaded from a filter
+ * file point into the file; the rest are owned.
+ */
+static int stem_cache_init(struct stem_cache *cache)
+{
+	int err = 0;
+
+	TRY(corpus_table_init(&cache->table));
+	cache->items = NULL;
+	cache->nitem = 0;
+	cache->nitem_max = 0;
+out:
+	return err;
+}
+
+
+static void stem_cache_destroy(struct stem_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->nitem; i++) {
+		if (cache->items[i].owned) {
+			corpus_free(cache->items[i].type.ptr);
+		}
+	}
+	corpus_free(cache->items);
+	corpus_table_destroy(&cache->table);
+}
+
+
+/*
+ * The cache keys are the type bytes, without the flag bits: the types
+ * from a filter file have their UTF-8 bits set, while the ones passed to
+ * the stemmer only have their sizes.
+ */
+static void stem_cache_key(const struct utf8lite_text *type,
+			   struct utf8lite_text *key)
+{
+	key->ptr = type->ptr;
+	key->attr = UTF8LITE_TEXT_SIZE(type);
+}
+
+
+static int stem_cache_find(const struct stem_cache *cache,
+			   const struct utf8lite_text *type, int *idptr)
+{
+	struct corpus_table_probe probe;
+	struct utf8lite_text key;
+	unsigned hash;
+	int id;
+
+	stem_cache_key(type, &key);
+	hash = (unsigned)utf8lite_text_hash(&key);
+
+	corpus_table_probe_make(&probe, &cache->table, hash);
+	while (corpus_table_probe_advance(&probe)) {
+		id = probe.current;
+		if (utf8lite_text_equals(&key, &cache->items[id].type)) {
+			if (idptr) {
+				*idptr = id;
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int stem_cache_rehash(struct stem_cache *cache)
+{
+	unsigned hash;
+	int err = 0, i;
+
+	TRY(corpus_table_reinit(&cache->table, cache->nitem));
+
+	for (i = 0; i < cache->nitem; i++) {
+		hash = (unsigned)utf8lite_text_hash(&cache->items[i].type);
+		corpus_table_add(&cache->table, hash, i);
+	}
+out:
+	return err;
+}
+
+
+static int stem_cache_add(struct stem_cache *cache,
+			  const struct utf8lite_text *type,
+			  const struct utf8lite_text *stem, int copy,
+			  int *idptr)
+{
+	struct stem_cache_item *item;
+	uint8_t *buf = NULL;
+	void *base;
+	size_t type_size, stem_size;
+	unsigned hash;
+	int err = 0, id, rehash;
+
+	if (stem_cache_find(cache, type, &id)) {
+		goto out;
+	}
+
+	if (cache->nitem == cache->nitem_max) {
+		base = cache->items;
+		TRY(corpus_array_grow(&base, &cache->nitem_max,
+				      sizeof(*cache->items), cache->nitem, 1));
+		cache->items = base;
+	}
+
+	type_size = UTF8LITE_TEXT_SIZE(type);
+	stem_size = stem->ptr ? UTF8LITE_TEXT_SIZE(stem) : 0;
+
+	id = cache->nitem;
+	item = &cache->items[id];
+	stem_cache_key(type, &item->type);
+	item->stem = *stem;
+	item->owned = 0;
+
+	if (copy) {
+		TRY_ALLOC(buf = corpus_malloc(type_size + stem_size + 1));
+		memcpy(buf, type->ptr, type_size);
+		item->type.ptr = buf;
+		if (stem->ptr) {
+			memcpy(buf + type_size, stem->ptr, stem_size);
+			item->stem.ptr = buf + type_size;
+		}
+		item->owned = 1;
+	}
+
+	rehash = (cache->nitem == (int)cache->table.capacity);
+	cache->nitem++;
+
+	if (rehash) {
+		if ((err = stem_cache_rehash(cache))) {
+			cache->nitem--;
+			corpus_free(buf);
+			goto out;
+		}
+	} else {
+		hash = (unsigned)utf8lite_text_hash(&item->type);
+		corpus_table_add(&cache->table, hash, id);
+	}
+out:
+	if (!err && idptr) {
+		*idptr = id;
+	}
+	return err;
+}
+
+
+/*
+ * Look up a stem in the shared pool, stemming and adding it there if it
+ * is missing. The filter only asks for the stem of a type once, so the
+ * lock gets taken once per distinct type, not once per token.
+ */
+static int stem_pooled(struct stem_pool *pool, struct stemmer *s,
+		       const struct utf8lite_text *type,
+		       struct utf8lite_text *stem)
+{
+	const uint8_t *stem_ptr;
+	int err = 0, found, id, stem_len;
+
+#ifdef _OPENMP
+	omp_set_lock(&pool->lock);
+#endif
+	found = stem_cache_find(&pool->cache, type, &id);
+	if (found) {
+		*stem = pool->cache.items[id].stem;
+	}
+#ifdef _OPENMP
+	omp_unset_lock(&pool->lock);
+#endif
+	if (found) {
+		goto out;
+	}
+
+	// stem outside the lock, with this thread's own snowball environment
+	TRY(s->base_func(type->ptr, (int)UTF8LITE_TEXT_SIZE(type), &stem_ptr,
+			 &stem_len, s->base_context));
+	stem->ptr = (uint8_t *)stem_ptr;
+	stem->attr = (stem_ptr && stem_len > 0) ? (size_t)stem_len : 0;
+
+	// another thread may have added the type in the meantime; the first
+	// one wins, and both stems are the same
+#ifdef _OPENMP
+	omp_set_lock(&pool->lock);
+#endif
+	err = stem_cache_add(&pool->cache, type, stem, 1, NULL);
+#ifdef _OPENMP
+	omp_unset_lock(&pool->lock);
+#endif
+out:
+	return err;
+}
+
+
+static int stem_cached(struct stemmer *s, const struct utf8lite_text *type,
+		       struct utf8lite_text *stem)
+{
+	struct stem_cache *cache = &s->cache;
+	const uint8_t *stem_ptr;
+	int err = 0, id, stem_len;
+
+	if (!stem_cache_find(cache, type, &id)) {
+		if (s->pool) {
+			TRY(stem_pooled(s->pool, s, type, stem));
+		} else {
+			TRY(s->base_func(type->ptr,
+					 (int)UTF8LITE_TEXT_SIZE(type),
+					 &stem_ptr, &stem_len,
+					 s->base_context));
+			stem->ptr = (uint8_t *)stem_ptr;
+			stem->attr = ((stem_ptr && stem_len > 0)
+				      ? (size_t)stem_len : 0);
+		}
+		// copy, since the pool and the stemmer's buffer are
+		// short-lived
+		TRY(stem_cache_add(cache, type, stem, 1, &id));
+	}
+
+	*stem = cache->items[id].stem;
+out:
+	return err;
+}
+
+
+/*
+ * The stem function that the filter calls: go through the stemmer's own
+ * cache if it has one, then through the pool if it is attached to one,
+ * and otherwise straight to the underlying stemmer.
+ */
+static int stem_dispatch(const uint8_t *ptr, int len,
+			 const uint8_t **stemptr, int *lenptr, void *context)
+{
+	struct stemmer *s = context;
+	struct utf8lite_text type, stem;
+	int err = 0;
+
+	if (!s->has_cache && !s->pool) {
+		return s->base_func(ptr, len, stemptr, lenptr,
+				    s->base_context);
+	}
+
+	type.ptr = (uint8_t *)ptr;
+	type.attr = (size_t)len;
+
+	if (s->has_cache) {
+		TRY(stem_cached(s, &type, &stem));
+	} else {
+		TRY(stem_pooled(s->pool, s, &type, &stem));
+	}
+
+	if (stemptr) {
+		*stemptr = stem.ptr;
+	}
+	if (lenptr) {
+		*lenptr = stem.ptr ? (int)UTF8LITE_TEXT_SIZE(&stem) : -1;
+	}
+out:
+	return err;
+}
+
+
+static void stemmer_init_dispatch(struct stemmer *s, corpus_stem_func func,
+				  void *context)
+{
+	s->base_func = func;
+	s->base_context = context;
+	s->stem_func = stem_dispatch;
+	s->stem_context = s;
+}
+
+
+static int stemmer_init_cache(struct stemmer *s)
+{
+	int err = 0;
+
+	if (s->has_cache) {
+		goto out;
+	}
+
+	TRY(stem_cache_init(&s->cache));
+	s->has_cache = 1;
+out:
+	return err;
+}
+
+
+/*
+ * Keep the stems that the stemmer computes, so that they can get saved.
+ * This does nothing for stemmers without a stem function.
+ */
+void stemmer_keep_stems(struct stemmer *s)
+{
+	int err = 0;
+
+	if (s->stem_func == stem_dispatch) {
+		TRY(stemmer_init_cache(s));
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+int stemmer_cache(struct stemmer *s, const struct utf8lite_text *type,
+		  const struct utf8lite_text *stem, int copy)
+{
+	int err = 0;
+
+	if (s->stem_func != stem_dispatch) {
+		goto out;
+	}
+
+	TRY(stemmer_init_cache(s));
+	TRY(stem_cache_add(&s->cache, type, stem, copy, NULL));
+out:
+	return err;
+}
+
+
+/*
+ * A stem pool lets the stemmers of parallel workers share their results.
+ * Each worker keeps its own snowball environment, which is not safe to
+ * share; the pool is a single cache for all of them, behind a lock.
+ */
+int stem_pool_init(struct stem_pool *pool, int nstemmer_max)
+{
+	int err = 0;
+
+	pool->stemmer = NULL;
+	pool->nstemmer = 0;
+	pool->nstemmer_max = nstemmer_max;
+
+	TRY_ALLOC(pool->stemmer = corpus_calloc(nstemmer_max,
+						sizeof(*pool->stemmer)));
+	if ((err = stem_cache_init(&pool->cache))) {
+		corpus_free(pool->stemmer);
+		goto out;
+	}
+#ifdef _OPENMP
+	omp_init_lock(&pool->lock);
+#endif
+out:
+	return err;
+}
+
+
+void stem_pool_destroy(struct stem_pool *pool)
+{
+#ifdef _OPENMP
+	omp_destroy_lock(&pool->lock);
+#endif
+	stem_cache_destroy(&pool->cache);
+	corpus_free(pool->stemmer);
+}
+
+
+/*
+ * Add a worker's stemmer to the pool. It only uses the pool between
+ * calls to stem_pool_attach and stem_pool_detach.
+ */
+void stem_pool_add(struct stem_pool *pool, struct stemmer *s)
+{
+	assert(pool->nstemmer < pool->nstemmer_max);
+	pool->stemmer[pool->nstemmer++] = s;
+}
+
+
+/*
+ * Attach the pool's stemmers to it while they run in parallel. The none
+ * and dictionary stemmers are thread-safe already, and R function
+ * stemmers never run in parallel, so only snowball stemmers use the pool.
+ */
+void stem_pool_attach(struct stem_pool *pool)
+{
+	struct stemmer *s;
+	int i;
+
+	for (i = 0; i < pool->nstemmer; i++) {
+		s = pool->stemmer[i];
+		if (s->type == STEMMER_SNOWBALL) {
+			s->pool = pool;
+		}
+	}
+}
+
+
+/*
+ * Detach the pool's stemmers after the parallel run. The first worker's
+ * stemmer belongs to the text, so it must not keep a pointer to the pool.
+ */
+void stem_pool_detach(struct stem_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nstemmer; i++) {
+		pool->stemmer[i]->pool = NULL;
+	}
+}
+
+
 void stemmer_init_none(struct stemmer *s)
 {
 	s->type = STEMMER_NONE;
+	s->name = NULL;
 	s->stem_func = NULL;
 	s->stem_context = NULL;
+	s->base_func = NULL;
+	s->base_context = NULL;
+	s->has_cache = 0;
+	s->pool = NULL;
 	s->error = 0;
 }
 
@@ -79,6 +489,10 @@ void stemmer_init_snowball(struct stemmer *s, const char *algorithm)
 	const char *name = stemmer_snowball_name(algorithm);
 	int err;
 
+	s->type = STEMMER_NONE;
+	s->has_cache = 0;
+	s->pool = NULL;
+
 	if (!name) {
 		s->error = CORPUS_ERROR_INVAL;
 		error("unrecognized stemmer: '%s'", algorithm);
@@ -87,23 +501,98 @@ void stemmer_init_snowball(struct stemmer *s, const char *algorithm)
 	TRY(corpus_stem_snowball_init(&s->value.snowball, name));
 
 	s->type = STEMMER_SNOWBALL;
-	s->stem_func = corpus_stem_snowball;
-	s->stem_context = &s->value.snowball;
+	s->name = name;
+	stemmer_init_dispatch(s, corpus_stem_snowball, &s->value.snowball);
 out:
 	s->error = err;
 	CHECK_ERROR(err);
 }
 
 
+/*
+ * Convert a string returned by an R stemming function to UTF-8 text,
+ * with a NULL pointer for NA.
+ */
+static void rfunc_stem_text(SEXP outchr, SEXP inchr,
+			    struct utf8lite_text *text)
+{
+	struct utf8lite_message msg;
+	const uint8_t *stem;
+	size_t stemlen;
+	cetype_t ce;
+
+	if (outchr == NA_STRING) {
+		text->ptr = NULL;
+		text->attr = 0;
+		return;
+	}
+
+	stem = (const uint8_t *)CHAR(outchr);
+	stemlen = (size_t)LENGTH(outchr);
+	ce = getCharCE(outchr);
+
+	switch (ce) {
+	case CE_ANY:
+	case CE_UTF8:
+		break;
+
+	case CE_NATIVE:
+#if defined(_WIN32) || defined(_WIN64)
+		stem = (const uint8_t *)translateCharUTF8(outchr);
+		stemlen = strlen((const char *)stem);
+#endif
+		break;
+
+	default:
+		error("'stemmer' returned a without"
+		      " \"UTF-8\" or native encoding for input \"%s\"",
+		      translateChar(inchr));
+		break;
+	}
+
+	if (utf8lite_text_assign(text, stem, stemlen, 0, &msg)) {
+		error("'stemmer' returned an invalid UTF-8 string"
+		      " for input \"%s\": %s", translateChar(inchr),
+		      msg.string);
+	}
+}
+
+
+/*
+ * Get the message for the error that R_tryEvalSilent caught, without
+ * its trailing newline.
+ */
+static const char *rfunc_error_message(void)
+{
+	SEXP fcall, ans;
+	const char *msg;
+	char *buf;
+	size_t len;
+
+	PROTECT(fcall = lang1(install("geterrmessage")));
+	PROTECT(ans = eval(fcall, R_BaseEnv));
+	msg = CHAR(STRING_ELT(ans, 0));
+
+	len = strlen(msg);
+	while (len > 0 && msg[len - 1] == '\n') {
+		len--;
+	}
+	buf = R_alloc(len + 1, 1);
+	memcpy(buf, msg, len);
+	buf[len] = '\0';
+
+	UNPROTECT(2);
+	return buf;
+}
+
+
 static int stem_rfunc(const uint8_t *ptr, int len, const uint8_t **stemptr,
 		      int *lenptr, void *context)
 {
 	SEXP str, inchr, outchr, fcall, ans;
 	struct stemmer *stemmer = context;
 	const uint8_t *stem;
-	struct utf8lite_message msg;
 	struct utf8lite_text text;
-	cetype_t ce;
 	int err = 0, nprot = 0, stemlen;
 
 	assert(!stemmer->error);
@@ -131,10 +620,9 @@ static int stem_rfunc(const uint8_t *ptr, int len, const uint8_t **stemptr,
 	// check for error
 	// see https://stackoverflow.com/a/27486741/6233565
 	if (err) {
-		// TODO: report the error message
-		error("'stemmer' raised an error for input \"%s\"",
-		      translateChar(inchr));
-    	}
+		error("'stemmer' raised an error for input \"%s\": %s",
+		      translateChar(inchr), rfunc_error_message());
+	}
 
 	// check for logical NA
 	if (TYPEOF(ans) == LGLSXP && XLENGTH(ans) == 1
@@ -155,35 +643,10 @@ static int stem_rfunc(const uint8_t *ptr, int len, const uint8_t **stemptr,
 	}
 
 	PROTECT(outchr = STRING_ELT(ans, 0)); nprot++;
-	if (outchr != NA_STRING) {
-		stem = (const uint8_t *)CHAR(outchr);
-		stemlen = LENGTH(outchr);
-		ce = getCharCE(outchr);
-
-		switch (ce) {
-		case CE_ANY:
-		case CE_UTF8:
-			break;
-
-		case CE_NATIVE:
-#if defined(_WIN32) || defined(_WIN64)
-			stem = (const uint8_t *)translateCharUTF8(outchr);
-			stemlen = (int)strlen(stem);
-#endif
-			break;
-
-		default:
-			error("'stemmer' returned a without"
-			      " \"UTF-8\" or native encoding for input \"%s\"",
-			      translateChar(inchr));
-			break;
-		}
-
-		if (utf8lite_text_assign(&text, stem, stemlen, 0, &msg)) {
-			error("'stemmer' returned an invalid UTF-8 string"
-			      " for input \"%s\": %s", translateChar(inchr),
-			      msg.string);
-		}
+	rfunc_stem_text(outchr, inchr, &text);
+	if (text.ptr) {
+		stem = text.ptr;
+		stemlen = (int)UTF8LITE_TEXT_SIZE(&text);
 	}
 out:
 	if (stemptr) {
@@ -200,19 +663,136 @@ out:
 }
 
 
+/*
+ * Stem the types that are not in the cache yet with a single call to a
+ * vectorized R stemming function, and add the results to the cache.
+ */
+void stemmer_batch(struct stemmer *s, const struct corpus_symtab_type *types,
+		   int ntype)
+{
+	SEXP sx, fcall, ans, inchr;
+	struct utf8lite_text type, stem;
+	R_xlen_t j, m;
+	int err = 0, nprot = 0, i, na;
+
+	if (!stemmer_batched(s)) {
+		return;
+	}
+
+	m = 0;
+	for (i = 0; i < ntype; i++) {
+		type.ptr = types[i].text.ptr;
+		type.attr = UTF8LITE_TEXT_SIZE(&types[i].text);
+		if (!stem_cache_find(&s->cache, &type, NULL)) {
+			m++;
+		}
+	}
+	if (m == 0) {
+		return;
+	}
+
+	PROTECT(sx = allocVector(STRSXP, m)); nprot++;
+	j = 0;
+	for (i = 0; i < ntype; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		type.ptr = types[i].text.ptr;
+		type.attr = UTF8LITE_TEXT_SIZE(&types[i].text);
+		if (!stem_cache_find(&s->cache, &type, NULL)) {
+			inchr = mkCharLenCE((const char *)type.ptr,
+					    (int)type.attr, CE_UTF8);
+			SET_STRING_ELT(sx, j++, inchr);
+		}
+	}
+
+	PROTECT(fcall = lang2(s->value.rfunc.fn, sx)); nprot++;
+	PROTECT(ans = R_tryEvalSilent(fcall, s->value.rfunc.rho, &err));
+	nprot++;
+
+	if (err) {
+		error("'stemmer' raised an error for a batch of %.0f"
+		      " inputs: %s", (double)m, rfunc_error_message());
+	}
+
+	// a logical NA result, either a scalar or one per input, means NA
+	// for every input
+	na = (TYPEOF(ans) == LGLSXP
+	      && (XLENGTH(ans) == 1 || XLENGTH(ans) == m));
+	for (j = 0; na && j < XLENGTH(ans); j++) {
+		na = (LOGICAL(ans)[j] == NA_LOGICAL);
+	}
+
+	if (!na) {
+		if (TYPEOF(ans) != STRSXP) {
+			error("'stemmer' returned a non-string value"
+			      " for a batch of inputs");
+		} else if (XLENGTH(ans) != m) {
+			error("'stemmer' returned %.0f values"
+			      " for a batch of %.0f inputs",
+			      (double)XLENGTH(ans), (double)m);
+		}
+	}
+
+	for (j = 0; j < m; j++) {
+		RCORPUS_CHECK_INTERRUPT(j);
+
+		inchr = STRING_ELT(sx, j);
+		type.ptr = (uint8_t *)CHAR(inchr);
+		type.attr = (size_t)LENGTH(inchr);
+
+		if (na) {
+			stem.ptr = NULL;
+			stem.attr = 0;
+		} else {
+			rfunc_stem_text(STRING_ELT(ans, j), inchr, &stem);
+		}
+
+		TRY(stem_cache_add(&s->cache, &type, &stem, 1, NULL));
+	}
+out:
+	UNPROTECT(nprot);
+	CHECK_ERROR(err);
+}
+
+
+int stemmer_batched(const struct stemmer *s)
+{
+	return (s->type == STEMMER_RFUNC && s->value.rfunc.vectorized);
+}
+
+
 void stemmer_init_rfunc(struct stemmer *s, SEXP fn, SEXP rho)
 {
+	SEXP vectorized = getAttrib(fn, install("vectorized"));
+	int err;
+
 	s->value.rfunc.fn = fn;
 	s->value.rfunc.rho = rho;
+	s->value.rfunc.vectorized = (TYPEOF(vectorized) == LGLSXP
+				     && XLENGTH(vectorized) == 1
+				     && LOGICAL(vectorized)[0] == TRUE);
 	s->type = STEMMER_RFUNC;
-	s->stem_func = stem_rfunc;
-	s->stem_context = s;
+	s->name = "<function>";
+	stemmer_init_dispatch(s, stem_rfunc, s);
+	s->has_cache = 0;
+	s->pool = NULL;
 	s->error = 0;
+
+	// a vectorized stemmer keeps the results of its batches
+	if (s->value.rfunc.vectorized && (err = stemmer_init_cache(s))) {
+		s->error = err;
+		stemmer_destroy(s);
+		CHECK_ERROR(err);
+	}
 }
 
 
 void stemmer_destroy(struct stemmer *s)
 {
+	if (s->has_cache) {
+		stem_cache_destroy(&s->cache);
+		s->has_cache = 0;
+	}
+
 	switch (s->type) {
 	case STEMMER_SNOWBALL:
 		corpus_stem_snowball_destroy(&s->value.snowball);
@@ -223,23 +803,343 @@ void stemmer_destroy(struct stemmer *s)
 }
 
 
-struct stem_snowball_context {
+#define STEM_DICT_TAG install("corpus::stem_dict")
+
+
+/*
+ * A dictionary stemmer maps terms to stems with a hash table built once
+ * from the (term, stem) pairs. The texts point into the R character
+ * vectors, which the external pointer keeps alive. Lookups do not call
+ * R, so threads can share the table.
+ */
+static void stem_dict_destroy(struct stem_dict *dict)
+{
+	corpus_free(dict->stems);
+	corpus_free(dict->terms);
+	corpus_table_destroy(&dict->table);
+}
+
+
+static void free_stem_dict(SEXP sdict)
+{
+	struct stem_dict *dict = R_ExternalPtrAddr(sdict);
+	R_SetExternalPtrAddr(sdict, NULL);
+
+	if (dict) {
+		stem_dict_destroy(dict);
+		corpus_free(dict);
+	}
+}
+
+
+static void charsxp_text(SEXP chr, struct utf8lite_text *text)
+{
+	if (chr == NA_STRING) {
+		text->ptr = NULL;
+		text->attr = 0;
+	} else {
+		text->ptr = (uint8_t *)CHAR(chr);
+		text->attr = (size_t)LENGTH(chr);
+	}
+}
+
+
+static int stem_dict_find(const struct stem_dict *dict,
+			  const struct utf8lite_text *term, int *idptr)
+{
+	struct corpus_table_probe probe;
+	unsigned hash = (unsigned)utf8lite_text_hash(term);
+	int id;
+
+	corpus_table_probe_make(&probe, &dict->table, hash);
+	while (corpus_table_probe_advance(&probe)) {
+		id = probe.current;
+		if (utf8lite_text_equals(term, &dict->terms[id])) {
+			if (idptr) {
+				*idptr = id;
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int stem_dict_init(struct stem_dict *dict, SEXP sterm, SEXP sstem,
+			  SEXP sdefault)
+{
+	struct utf8lite_text term;
+	R_xlen_t i, n = XLENGTH(sterm);
+	unsigned hash;
+	int err = 0, nterm;
+
+	TRY(corpus_table_init(&dict->table));
+
+	if (n > 0) {
+		TRY_ALLOC(dict->terms = corpus_malloc(n
+						      * sizeof(*dict->terms)));
+		TRY_ALLOC(dict->stems = corpus_malloc(n
+						      * sizeof(*dict->stems)));
+		TRY(corpus_table_reinit(&dict->table, (int)n));
+	}
+
+	// the first entry for a duplicated term wins
+	nterm = 0;
+	for (i = 0; i < n; i++) {
+		charsxp_text(STRING_ELT(sterm, i), &term);
+		if (!term.ptr || stem_dict_find(dict, &term, NULL)) {
+			continue;
+		}
+
+		dict->terms[nterm] = term;
+		charsxp_text(STRING_ELT(sstem, i), &dict->stems[nterm]);
+
+		hash = (unsigned)utf8lite_text_hash(&term);
+		corpus_table_add(&dict->table, hash, nterm);
+		dict->nterm = ++nterm;
+	}
+
+	// a NULL default leaves unknown terms as-is; NA drops them
+	if (sdefault != R_NilValue) {
+		charsxp_text(STRING_ELT(sdefault, 0), &dict->default_stem);
+		dict->has_default = 1;
+	}
+out:
+	return err;
+}
+
+
+SEXP alloc_stem_dict(SEXP sterm, SEXP sstem, SEXP sdefault)
+{
+	SEXP ans, sprot;
+
+	if (TYPEOF(sterm) != STRSXP || TYPEOF(sstem) != STRSXP
+			|| XLENGTH(sterm) != XLENGTH(sstem)) {
+		error("invalid 'term' or 'stem' argument");
+	}
+	if (XLENGTH(sterm) > INT_MAX) {
+		error("'term' length exceeds maximum (%d)", INT_MAX);
+	}
+	if (sdefault != R_NilValue && (TYPEOF(sdefault) != STRSXP
+				       || XLENGTH(sdefault) != 1)) {
+		error("invalid 'default' argument");
+	}
+
+	PROTECT(sprot = allocVector(VECSXP, 3));
+	SET_VECTOR_ELT(sprot, 0, sterm);
+	SET_VECTOR_ELT(sprot, 1, sstem);
+	SET_VECTOR_ELT(sprot, 2, sdefault);
+
+	PROTECT(ans = R_MakeExternalPtr(NULL, STEM_DICT_TAG, sprot));
+	R_RegisterCFinalizerEx(ans, free_stem_dict, TRUE);
+
+	// build the table now, rather than on first use
+	as_stem_dict(ans);
+
+	UNPROTECT(2);
+	return ans;
+}
+
+
+int is_stem_dict(SEXP sdict)
+{
+	return ((TYPEOF(sdict) == EXTPTRSXP)
+		&& (R_ExternalPtrTag(sdict) == STEM_DICT_TAG));
+}
+
+
+const struct stem_dict *as_stem_dict(SEXP sdict)
+{
+	SEXP sprot;
+	struct stem_dict *dict;
+	int err = 0;
+
+	if (!is_stem_dict(sdict)) {
+		error("invalid 'stem_dict' object");
+	}
+
+	dict = R_ExternalPtrAddr(sdict);
+	if (dict) {
+		return dict;
+	}
+
+	// the address is NULL for a new or deserialized object
+	sprot = R_ExternalPtrProtected(sdict);
+	R_RegisterCFinalizerEx(sdict, free_stem_dict, TRUE);
+
+	TRY_ALLOC(dict = corpus_calloc(1, sizeof(*dict)));
+	if ((err = stem_dict_init(dict, VECTOR_ELT(sprot, 0),
+				  VECTOR_ELT(sprot, 1),
+				  VECTOR_ELT(sprot, 2)))) {
+		stem_dict_destroy(dict);
+		corpus_free(dict);
+		goto out;
+	}
+	R_SetExternalPtrAddr(sdict, dict);
+out:
+	CHECK_ERROR(err);
+	return dict;
+}
+
+
+/*
+ * Look up the stem for a term. Return 0 if the term stays as-is.
+ */
+static int stem_dict_get(const struct stem_dict *dict,
+			 const struct utf8lite_text *term,
+			 const struct utf8lite_text **stemptr)
+{
+	int id;
+
+	if (stem_dict_find(dict, term, &id)) {
+		*stemptr = &dict->stems[id];
+		return 1;
+	} else if (dict->has_default) {
+		*stemptr = &dict->default_stem;
+		return 1;
+	}
+
+	*stemptr = term;
+	return 0;
+}
+
+
+static int stem_dict_func(const uint8_t *ptr, int len,
+			  const uint8_t **stemptr, int *lenptr, void *context)
+{
+	const struct stem_dict *dict = context;
+	const struct utf8lite_text *stem;
+	struct utf8lite_text term;
+
+	term.ptr = (uint8_t *)ptr;
+	term.attr = (size_t)len;
+	stem_dict_get(dict, &term, &stem);
+
+	if (stemptr) {
+		*stemptr = stem->ptr;
+	}
+	if (lenptr) {
+		*lenptr = stem->ptr ? (int)UTF8LITE_TEXT_SIZE(stem) : -1;
+	}
+	return 0;
+}
+
+
+void stemmer_init_dict(struct stemmer *s, SEXP sdict)
+{
+	const struct stem_dict *dict = as_stem_dict(sdict);
+
+	s->value.dict = dict;
+	s->type = STEMMER_DICT;
+	s->name = NULL;
+	stemmer_init_dispatch(s, stem_dict_func, (void *)dict);
+	s->has_cache = 0;
+	s->pool = NULL;
+	s->error = 0;
+}
+
+
+SEXP stem_dict(SEXP sdict, SEXP sx)
+{
+	SEXP ans, elt;
+	const struct stem_dict *dict;
+	const struct utf8lite_text *stem;
+	struct utf8lite_text term;
+	R_xlen_t i, n;
+
+	dict = as_stem_dict(sdict);
+
+	if (sx == R_NilValue) {
+		return R_NilValue;
+	}
+
+	PROTECT(ans = duplicate(sx));
+	n = XLENGTH(ans);
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		elt = STRING_ELT(ans, i);
+		if (elt == NA_STRING) {
+			continue;
+		}
+
+		charsxp_text(elt, &term);
+		if (!stem_dict_get(dict, &term, &stem)) {
+			continue;
+		}
+
+		if (stem->ptr) {
+			elt = mkCharLenCE((const char *)stem->ptr,
+					  (int)UTF8LITE_TEXT_SIZE(stem),
+					  CE_UTF8);
+		} else {
+			elt = NA_STRING;
+		}
+		SET_STRING_ELT(ans, i, elt);
+	}
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/*
+ * stem_snowball() stems each distinct input once. The inputs get
+ * deduplicated by CHARSXP address: R caches its strings, so equal
+ * strings in the same encoding share a CHARSXP. The distinct inputs get
+ * split into contiguous ranges, one per worker, and each worker has its
+ * own snowball environment and appends its stems to its own buffer.
+ * Only the main thread touches R objects.
+ */
+struct stem_snowball_worker {
 	struct corpus_stem_snowball snowball;
+	uint8_t *buf;
+	size_t size, size_max;
+	int begin, end;
 	int has_snowball;
+	int error;
+};
+
+
+struct stem_snowball_context {
+	struct corpus_table table;
+	SEXP *types;
+	struct utf8lite_text *text;
+	size_t *offset;
+	int *length;
+	struct stem_snowball_worker *worker;
+	const char *name;
+	int ntype, ntype_max;
+	int nworker;
+	int has_table, has_worker;
 };
 
 
+static unsigned charsxp_hash(SEXP chr)
+{
+	uint64_t h = (uint64_t)(uintptr_t)chr;
+
+	// CHARSXP addresses are aligned, so mix the high bits down
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	return (unsigned)h;
+}
+
+
 static void stem_snowball_context_init(struct stem_snowball_context *ctx,
 				       SEXP salgorithm)
 {
-	const char *algorithm, *name;
+	const char *algorithm;
 	int err = 0;
 
 	algorithm = CHAR(STRING_ELT(salgorithm, 0));
-	name = stemmer_snowball_name(algorithm);
+	ctx->name = stemmer_snowball_name(algorithm);
 
-	TRY(corpus_stem_snowball_init(&ctx->snowball, name));
-	ctx->has_snowball = 1;
+	TRY(corpus_table_init(&ctx->table));
+	ctx->has_table = 1;
 out:
 	CHECK_ERROR(err);
 }
@@ -248,20 +1148,163 @@ out:
 static void stem_snowball_context_destroy(void *obj)
 {
 	struct stem_snowball_context *ctx = obj;
+	struct stem_snowball_worker *w;
 
-	if (ctx->has_snowball) {
-		corpus_stem_snowball_destroy(&ctx->snowball);
+	while (ctx->has_worker > 0) {
+		ctx->has_worker--;
+		w = &ctx->worker[ctx->has_worker];
+		if (w->has_snowball) {
+			corpus_stem_snowball_destroy(&w->snowball);
+		}
+		corpus_free(w->buf);
+	}
+	corpus_free(ctx->worker);
+	corpus_free(ctx->length);
+	corpus_free(ctx->offset);
+	corpus_free(ctx->text);
+	corpus_free(ctx->types);
+
+	if (ctx->has_table) {
+		corpus_table_destroy(&ctx->table);
 	}
 }
 
 
-SEXP stem_snowball(SEXP x, SEXP algorithm)
+static int stem_snowball_find(const struct stem_snowball_context *ctx,
+			      SEXP chr, unsigned hash, int *idptr)
+{
+	struct corpus_table_probe probe;
+
+	corpus_table_probe_make(&probe, &ctx->table, hash);
+	while (corpus_table_probe_advance(&probe)) {
+		if (ctx->types[probe.current] == chr) {
+			*idptr = probe.current;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static int stem_snowball_add(struct stem_snowball_context *ctx, SEXP chr)
 {
-	SEXP ans, elt, sctx;
+	void *base;
+	unsigned hash = charsxp_hash(chr);
+	int err = 0, i, id;
+
+	if (stem_snowball_find(ctx, chr, hash, &id)) {
+		goto out;
+	}
+
+	if (ctx->ntype == ctx->ntype_max) {
+		base = ctx->types;
+		TRY(corpus_array_grow(&base, &ctx->ntype_max,
+				      sizeof(*ctx->types), ctx->ntype, 1));
+		ctx->types = base;
+	}
+
+	id = ctx->ntype;
+	ctx->types[id] = chr;
+	ctx->ntype++;
+
+	if (ctx->ntype > (int)ctx->table.capacity) {
+		TRY(corpus_table_reinit(&ctx->table, ctx->ntype));
+		for (i = 0; i < ctx->ntype; i++) {
+			corpus_table_add(&ctx->table,
+					 charsxp_hash(ctx->types[i]), i);
+		}
+	} else {
+		corpus_table_add(&ctx->table, hash, id);
+	}
+out:
+	return err;
+}
+
+
+static void stem_snowball_start_workers(struct stem_snowball_context *ctx,
+					int nworker)
+{
+	struct stem_snowball_worker *w;
+	int err = 0, i;
+
+	TRY_ALLOC(ctx->text = corpus_malloc(ctx->ntype * sizeof(*ctx->text)
+					    + 1));
+	TRY_ALLOC(ctx->offset = corpus_malloc(ctx->ntype
+					      * sizeof(*ctx->offset) + 1));
+	TRY_ALLOC(ctx->length = corpus_malloc(ctx->ntype
+					      * sizeof(*ctx->length) + 1));
+
+	// CHAR() is not safe to call from the workers
+	for (i = 0; i < ctx->ntype; i++) {
+		charsxp_text(ctx->types[i], &ctx->text[i]);
+	}
+
+	TRY_ALLOC(ctx->worker = corpus_calloc(nworker, sizeof(*ctx->worker)));
+	ctx->nworker = nworker;
+
+	for (i = 0; i < nworker; i++) {
+		w = &ctx->worker[i];
+		ctx->has_worker = i + 1;
+
+		TRY(corpus_stem_snowball_init(&w->snowball, ctx->name));
+		w->has_snowball = 1;
+
+		w->begin = (int)(((double)ctx->ntype * i) / nworker);
+		w->end = (int)(((double)ctx->ntype * (i + 1)) / nworker);
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+/* runs on a worker thread */
+static void stem_snowball_worker_run(struct stem_snowball_worker *w,
+				     const struct utf8lite_text *text,
+				     size_t *offset, int *length)
+{
+	const uint8_t *stem;
+	void *base;
+	size_t size;
+	int err = 0, i, len, stem_len;
+
+	for (i = w->begin; i < w->end; i++) {
+		len = (int)UTF8LITE_TEXT_SIZE(&text[i]);
+		TRY(corpus_stem_snowball(text[i].ptr, len, &stem, &stem_len,
+					 &w->snowball));
+
+		// a length of -1 means the input is its own stem
+		if (stem_len == len && memcmp(stem, text[i].ptr, len) == 0) {
+			length[i] = -1;
+			continue;
+		}
+
+		if ((size_t)stem_len > w->size_max - w->size) {
+			size = w->size_max ? w->size_max : 256;
+			while ((size_t)stem_len > size - w->size) {
+				size *= 2;
+			}
+			TRY_ALLOC(base = corpus_realloc(w->buf, size));
+			w->buf = base;
+			w->size_max = size;
+		}
+
+		memcpy(w->buf + w->size, stem, stem_len);
+		offset[i] = w->size;
+		length[i] = stem_len;
+		w->size += stem_len;
+	}
+out:
+	w->error = err;
+}
+
+
+SEXP stem_snowball(SEXP x, SEXP algorithm, SEXP sthreads)
+{
+	SEXP ans, elt, sctx, sstems;
 	struct stem_snowball_context *ctx;
-	const uint8_t *ptr, *stemptr;
+	const struct stem_snowball_worker *w;
 	R_xlen_t i, n;
-	int err = 0, nprot = 0, len, stemlen;
+	int err = 0, nprot = 0, id, j, nworker;
 
 	if (x == R_NilValue || algorithm == R_NilValue) {
 		return x;
@@ -274,8 +1317,53 @@ SEXP stem_snowball(SEXP x, SEXP algorithm)
         ctx = as_context(sctx);
 	stem_snowball_context_init(ctx, algorithm);
 
+	n = XLENGTH(x);
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		elt = STRING_ELT(x, i);
+		if (elt != NA_STRING) {
+			TRY(stem_snowball_add(ctx, elt));
+		}
+	}
+
+	nworker = thread_count(sthreads, ctx->ntype);
+	stem_snowball_start_workers(ctx, nworker);
+
+	if (nworker > 1) {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nworker)
+#endif
+		for (j = 0; j < nworker; j++) {
+			stem_snowball_worker_run(&ctx->worker[j], ctx->text,
+						 ctx->offset, ctx->length);
+		}
+	} else {
+		stem_snowball_worker_run(&ctx->worker[0], ctx->text,
+					 ctx->offset, ctx->length);
+	}
+
+	for (j = 0; j < nworker; j++) {
+		TRY(ctx->worker[j].error);
+	}
+
+	PROTECT(sstems = allocVector(STRSXP, ctx->ntype)); nprot++;
+	for (j = 0; j < nworker; j++) {
+		w = &ctx->worker[j];
+		for (id = w->begin; id < w->end; id++) {
+			RCORPUS_CHECK_INTERRUPT(id);
+			if (ctx->length[id] < 0) {
+				elt = ctx->types[id];
+			} else {
+				elt = mkCharLenCE((const char *)w->buf
+						  + ctx->offset[id],
+						  ctx->length[id], CE_UTF8);
+			}
+			SET_STRING_ELT(sstems, id, elt);
+		}
+	}
+
 	PROTECT(ans = duplicate(x)); nprot++;
-	n = XLENGTH(ans);
 
 	for (i = 0; i < n; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
@@ -284,13 +1372,8 @@ SEXP stem_snowball(SEXP x, SEXP algorithm)
 			continue;
 		}
 
-		ptr = (const uint8_t *)CHAR(elt);
-		len = LENGTH(elt);
-		TRY(corpus_stem_snowball(ptr, len, &stemptr, &stemlen,
-					 &ctx->snowball));
-
-		elt = mkCharLenCE((const char *)stemptr, stemlen, CE_UTF8);
-		SET_STRING_ELT(ans, i, elt);
+		stem_snowball_find(ctx, elt, charsxp_hash(elt), &id);
+		SET_STRING_ELT(ans, i, STRING_ELT(sstems, id));
 	}
 out:
 	CHECK_ERROR(err);
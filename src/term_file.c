@@ -0,0 +1,652 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "rcorpus.h"
+
+/*
+ * A term matrix file stores the non-zero entries of a document-by-term
+ * count matrix in coordinate (COO) format, in native byte order:
+ *
+ *     header:  char magic[8], int64 nrow, int64 ncol, int64 nz,
+ *              int64 nchunk, int64 sorted
+ *     chunk:   int64 size, int32 row[size], int32 col[size],
+ *              double count[size]
+ *
+ * Row and column indices are 0-based. The column dictionary goes in a
+ * separate file, with one JSON string per line, in the order the terms
+ * first appeared. When 'sorted' is nonzero, the reader puts the columns
+ * in sorted order, the same as 'term_matrix' does without a 'select'.
+ */
+
+#define TERM_FILE_MAGIC "corpusTM"
+#define TERM_FILE_HEADER_SIZE (8 + 5 * sizeof(int64_t))
+
+// maximum number of entries to buffer before writing a chunk
+#define TERM_FILE_CHUNK_MAX (1 << 20)
+
+
+struct context {
+	struct utf8lite_render render;
+	struct corpus_termset termset;
+	struct corpus_ngram **ngram;
+	R_xlen_t *last;
+	FILE *file;
+	FILE *terms_file;
+	const char *file_name;
+	const char *terms_name;
+	int *buffer;
+	int *ngram_set;
+	int32_t *row;
+	int32_t *col;
+	double *count;
+	int64_t nz;
+	int64_t nchunk;
+	int nbuf;
+	int ngram_max;
+	R_xlen_t ngroup;
+	int has_render, has_termset;
+};
+
+
+static void context_init(struct context *ctx, SEXP sngrams,
+			 const struct termset *select, R_xlen_t ngroup)
+{
+	const int *ngrams;
+	R_xlen_t i, n;
+	int ngram_max;
+	int err = 0;
+
+	TRY(utf8lite_render_init(&ctx->render, UTF8LITE_ESCAPE_CONTROL
+					       | UTF8LITE_ESCAPE_DQUOTE));
+	ctx->has_render = 1;
+
+	if (sngrams != R_NilValue) {
+		n = XLENGTH(sngrams);
+		ngrams = INTEGER(sngrams);
+		ngram_max = 1;
+
+		for (i = 0; i < n; i++) {
+			if (ngrams[i] > ngram_max) {
+				ngram_max = ngrams[i];
+			}
+		}
+	} else {
+		n = 0;
+		ngrams = NULL;
+		ngram_max = select ? select->max_length : 1;
+	}
+
+	ctx->ngram_max = ngram_max;
+	ctx->buffer = (void *)R_alloc(ngram_max, sizeof(*ctx->buffer));
+	ctx->ngram_set = (void *)R_alloc(ngram_max + 1,
+					 sizeof(*ctx->ngram_set));
+	memset(ctx->ngram_set, 0, (ngram_max + 1) * sizeof(*ctx->ngram_set));
+
+	if (sngrams != R_NilValue) {
+		for (i = 0; i < n; i++) {
+			ctx->ngram_set[ngrams[i]] = 1;
+		}
+	} else {
+		for (i = 0; i < ngram_max; i++) {
+			ctx->ngram_set[i + 1] = 1;
+		}
+	}
+
+	// the n-grams for a group only exist between its first and last
+	// texts; most of these pointers stay NULL
+	if (ngroup > 0) {
+		TRY_ALLOC(ctx->ngram = corpus_calloc(ngroup,
+						     sizeof(*ctx->ngram)));
+	}
+	ctx->ngroup = ngroup;
+
+	TRY_ALLOC(ctx->row = corpus_malloc(TERM_FILE_CHUNK_MAX
+					   * sizeof(*ctx->row)));
+	TRY_ALLOC(ctx->col = corpus_malloc(TERM_FILE_CHUNK_MAX
+					   * sizeof(*ctx->col)));
+	TRY_ALLOC(ctx->count = corpus_malloc(TERM_FILE_CHUNK_MAX
+					     * sizeof(*ctx->count)));
+
+	if (!select) {
+		TRY(corpus_termset_init(&ctx->termset));
+		ctx->has_termset = 1;
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+static void context_destroy(void *obj)
+{
+	struct context *ctx = obj;
+	R_xlen_t g;
+
+	if (ctx->terms_file) {
+		fclose(ctx->terms_file);
+	}
+	if (ctx->file) {
+		fclose(ctx->file);
+	}
+
+	corpus_free(ctx->count);
+	corpus_free(ctx->col);
+	corpus_free(ctx->row);
+	corpus_free(ctx->last);
+
+	for (g = 0; g < ctx->ngroup && ctx->ngram; g++) {
+		if (ctx->ngram[g]) {
+			corpus_ngram_destroy(ctx->ngram[g]);
+			corpus_free(ctx->ngram[g]);
+		}
+	}
+	corpus_free(ctx->ngram);
+
+	if (ctx->has_termset) {
+		corpus_termset_destroy(&ctx->termset);
+	}
+	if (ctx->has_render) {
+		utf8lite_render_destroy(&ctx->render);
+	}
+}
+
+
+static void context_write_header(struct context *ctx, int64_t nrow,
+				 int64_t ncol, int64_t sorted)
+{
+	FILE *file = ctx->file;
+
+	if (fseek(file, 0, SEEK_SET) != 0) {
+		error("failed writing to file '%s'", ctx->file_name);
+	}
+
+	write_file(file, ctx->file_name, TERM_FILE_MAGIC, 1, 8);
+	write_file(file, ctx->file_name, &nrow, sizeof(nrow), 1);
+	write_file(file, ctx->file_name, &ncol, sizeof(ncol), 1);
+	write_file(file, ctx->file_name, &ctx->nz, sizeof(ctx->nz), 1);
+	write_file(file, ctx->file_name, &ctx->nchunk, sizeof(ctx->nchunk),
+		   1);
+	write_file(file, ctx->file_name, &sorted, sizeof(sorted), 1);
+}
+
+
+static void context_flush(struct context *ctx)
+{
+	const char *name = ctx->file_name;
+	int64_t size = ctx->nbuf;
+
+	if (size == 0) {
+		return;
+	}
+
+	write_file(ctx->file, name, &size, sizeof(size), 1);
+	write_file(ctx->file, name, ctx->row, sizeof(*ctx->row), ctx->nbuf);
+	write_file(ctx->file, name, ctx->col, sizeof(*ctx->col), ctx->nbuf);
+	write_file(ctx->file, name, ctx->count, sizeof(*ctx->count),
+		   ctx->nbuf);
+
+	ctx->nz += size;
+	ctx->nchunk++;
+	ctx->nbuf = 0;
+}
+
+
+/*
+ * Write the counts for a finished group and free its n-grams.
+ */
+static void context_finish(struct context *ctx, R_xlen_t g,
+			   const struct termset *select)
+{
+	struct corpus_ngram *ngram = ctx->ngram[g];
+	struct corpus_ngram_iter it;
+	int err = 0, term_id;
+
+	if (!ngram) {
+		return;
+	}
+
+	corpus_ngram_iter_make(&it, ngram, ctx->buffer);
+	while (corpus_ngram_iter_advance(&it)) {
+		if (!ctx->ngram_set[it.length]) {
+			continue;
+		}
+
+		if (select) {
+			if (!corpus_termset_has(&select->set, it.type_ids,
+						it.length, &term_id)) {
+				continue;
+			}
+		} else {
+			TRY(corpus_termset_add(&ctx->termset, it.type_ids,
+					       it.length, &term_id));
+		}
+
+		if (ctx->nbuf == TERM_FILE_CHUNK_MAX) {
+			context_flush(ctx);
+		}
+
+		ctx->row[ctx->nbuf] = (int32_t)g;
+		ctx->col[ctx->nbuf] = (int32_t)term_id;
+		ctx->count[ctx->nbuf] = it.weight;
+		ctx->nbuf++;
+	}
+
+	corpus_ngram_destroy(ngram);
+	corpus_free(ngram);
+	ctx->ngram[g] = NULL;
+out:
+	CHECK_ERROR(err);
+}
+
+
+static void context_write_terms(struct context *ctx,
+				const struct corpus_termset *terms,
+				const struct corpus_symtab_type *types)
+{
+	const struct utf8lite_text *type;
+	const int *type_ids;
+	int err = 0, i, j, m;
+
+	for (i = 0; i < terms->nitem; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		type_ids = terms->items[i].type_ids;
+		m = terms->items[i].length;
+
+		for (j = 0; j < m; j++) {
+			type = &types[type_ids[j]].text;
+			if (j > 0) {
+				utf8lite_render_char(&ctx->render, ' ');
+			}
+			utf8lite_render_text(&ctx->render, type);
+		}
+		TRY(ctx->render.error);
+
+		// the render escapes quotes, so write the delimiters directly
+		write_file(ctx->terms_file, ctx->terms_name, "\"", 1, 1);
+		write_file(ctx->terms_file, ctx->terms_name,
+			   ctx->render.string, 1, ctx->render.length);
+		write_file(ctx->terms_file, ctx->terms_name, "\"\n", 1, 2);
+		utf8lite_render_clear(&ctx->render);
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+SEXP write_term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup,
+		       SEXP sfile, SEXP sterms_file)
+{
+	SEXP ans, sctx, stext;
+	struct context *ctx;
+	const struct utf8lite_text *text;
+	struct corpus_filter *filter;
+	const struct termset *select;
+	const struct corpus_termset *terms;
+	const int *group;
+	R_xlen_t i, n, g, ngroup;
+	int err = 0, type_id, nprot = 0;
+
+	PROTECT(stext = coerce_text(sx)); nprot++;
+	text = as_text(stext, &n);
+	filter = text_filter(stext);
+
+	if (sngrams != R_NilValue) {
+		PROTECT(sngrams = coerceVector(sngrams, INTSXP)); nprot++;
+	}
+
+	select = NULL;
+	if (sselect != R_NilValue) {
+		PROTECT(sselect = alloc_termset(sselect, "select", filter, 0));
+		nprot++;
+		select = as_termset(sselect);
+	}
+
+	if (sgroup != R_NilValue) {
+		ngroup = XLENGTH(getAttrib(sgroup, R_LevelsSymbol));
+		group = INTEGER(sgroup);
+	} else {
+		ngroup = n;
+		group = NULL;
+	}
+
+	if (ngroup > INT32_MAX) {
+		error("number of rows (%"PRIu64") exceeds maximum (%d)",
+		      (uint64_t)ngroup, INT32_MAX);
+	}
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+        ctx = as_context(sctx);
+	context_init(ctx, sngrams, select, ngroup);
+
+	ctx->file_name = file_path(sfile);
+	ctx->file = open_file(ctx->file_name);
+
+	// leave room for the header; it gets written at the end
+	context_write_header(ctx, 0, 0, 0);
+
+	// find the last text in each group, so that we know when the group
+	// is finished
+	if (group) {
+		TRY_ALLOC(ctx->last = corpus_malloc((ngroup ? ngroup : 1)
+						    * sizeof(*ctx->last)));
+		for (g = 0; g < ngroup; g++) {
+			ctx->last[g] = -1;
+		}
+		for (i = 0; i < n; i++) {
+			if (group[i] != NA_INTEGER) {
+				ctx->last[group[i] - 1] = i;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (!group) {
+			g = i;
+		} else if (group[i] == NA_INTEGER) {
+			continue;
+		} else {
+			assert(0 < group[i] && group[i] <= ngroup);
+			g = (R_xlen_t)(group[i] - 1);
+		}
+
+		if (!ctx->ngram[g]) {
+			TRY_ALLOC(ctx->ngram[g] = corpus_malloc(
+						sizeof(*ctx->ngram[g])));
+			if ((err = corpus_ngram_init(ctx->ngram[g],
+						     ctx->ngram_max))) {
+				corpus_free(ctx->ngram[g]);
+				ctx->ngram[g] = NULL;
+				goto out;
+			}
+		}
+
+		TRY(corpus_filter_start(filter, &text[i]));
+
+		while (corpus_filter_advance(filter)) {
+			type_id = filter->type_id;
+			if (type_id == CORPUS_TYPE_NONE) {
+				continue;
+			} else if (type_id < 0) {
+				TRY(corpus_ngram_break(ctx->ngram[g]));
+				continue;
+			}
+
+			TRY(corpus_ngram_add(ctx->ngram[g], type_id, 1));
+		}
+		TRY(filter->error);
+
+		TRY(corpus_ngram_break(ctx->ngram[g]));
+
+		if (!group || ctx->last[g] == i) {
+			context_finish(ctx, g, select);
+		}
+	}
+	context_flush(ctx);
+
+	terms = select ? &select->set : &ctx->termset;
+	context_write_header(ctx, (int64_t)ngroup, (int64_t)terms->nitem,
+			     select ? 0 : 1);
+
+	if (fclose(ctx->file) != 0) {
+		ctx->file = NULL;
+		error("failed writing to file '%s'", ctx->file_name);
+	}
+	ctx->file = NULL;
+
+	ctx->terms_name = file_path(sterms_file);
+	ctx->terms_file = open_file(ctx->terms_name);
+	context_write_terms(ctx, terms, filter->symtab.types);
+
+	if (fclose(ctx->terms_file) != 0) {
+		ctx->terms_file = NULL;
+		error("failed writing to file '%s'", ctx->terms_name);
+	}
+	ctx->terms_file = NULL;
+
+	PROTECT(ans = ScalarReal((double)ctx->nz)); nprot++;
+out:
+	CHECK_ERROR(err);
+	free_context(sctx);
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+/*
+ * Check the chunks of a term matrix file and count the entries in each
+ * row, adding the counts to 'rowptr[1:nrow]'. Return nonzero if the
+ * chunks are malformed or an index is out of range.
+ */
+static int term_file_scan(const uint8_t *ptr, const uint8_t *end,
+			  int64_t nchunk, int64_t nz, int nrow, int ncol,
+			  int *rowptr)
+{
+	const uint8_t *row, *col;
+	int64_t size, k, l, off;
+	int32_t i, j;
+
+	off = 0;
+	for (k = 0; k < nchunk; k++) {
+		RCORPUS_CHECK_INTERRUPT(k);
+
+		if ((size_t)(end - ptr) < sizeof(size)) {
+			return 1;
+		}
+		memcpy(&size, ptr, sizeof(size));
+		ptr += sizeof(size);
+
+		if (size < 0 || size > nz - off
+				|| (size_t)(end - ptr) / 16 < (size_t)size) {
+			return 1;
+		}
+
+		row = ptr;
+		col = row + size * sizeof(int32_t);
+		for (l = 0; l < size; l++) {
+			memcpy(&i, row + l * sizeof(i), sizeof(i));
+			memcpy(&j, col + l * sizeof(j), sizeof(j));
+			if (i < 0 || i >= nrow || j < 0 || j >= ncol) {
+				return 1;
+			}
+			rowptr[i + 1]++;
+		}
+
+		ptr += size * 16;
+		off += size;
+	}
+
+	return (off != nz);
+}
+
+
+/*
+ * Put the entries of a checked term matrix file in the row buckets
+ * starting at 'pos', mapping the columns through 'col_map' if it is
+ * non-NULL. Within a row, the columns stay in file order.
+ */
+static void term_file_scatter(const uint8_t *ptr, int64_t nchunk,
+			      const int *col_map, int *pos, int *col,
+			      double *val)
+{
+	const uint8_t *row, *cols, *count;
+	int64_t size, k, l;
+	int32_t i, j;
+	double x;
+	int off;
+
+	for (k = 0; k < nchunk; k++) {
+		RCORPUS_CHECK_INTERRUPT(k);
+
+		memcpy(&size, ptr, sizeof(size));
+		ptr += sizeof(size);
+
+		row = ptr;
+		cols = row + size * sizeof(int32_t);
+		count = cols + size * sizeof(int32_t);
+		for (l = 0; l < size; l++) {
+			memcpy(&i, row + l * sizeof(i), sizeof(i));
+			memcpy(&j, cols + l * sizeof(j), sizeof(j));
+			memcpy(&x, count + l * sizeof(x), sizeof(x));
+			off = pos[i]++;
+			col[off] = col_map ? col_map[j] : j;
+			val[off] = x;
+		}
+
+		ptr += size * 16;
+	}
+}
+
+
+/*
+ * Read a term matrix file into a "dgCMatrix". The entries go straight
+ * from the memory map into row buckets, and then through 'transpose_csc'
+ * into column-major order with sorted row indices; a second transpose
+ * gives the transposed matrix. Nothing passes through R-level triplets.
+ */
+SEXP read_term_matrix(SEXP sfile, SEXP scol_names, SEXP srow_names,
+		      SEXP stranspose)
+{
+	SEXP ans, sbuf, sp, si, sx, sdim, sdimnames;
+	const struct corpus_filebuf *buf;
+	const uint8_t *ptr, *end;
+	int64_t nrow, ncol, nz, nchunk, sorted;
+	int *rowptr, *pos, *col, *colptr, *row, *col_map;
+	double *val, *cval;
+	int i, transpose, nprot = 0;
+
+	PROTECT(sbuf = alloc_filebuf(sfile)); nprot++;
+	buf = as_filebuf(sbuf);
+	transpose = (LOGICAL(stranspose)[0] == TRUE);
+
+	ptr = buf->map_addr;
+	end = ptr + buf->map_size;
+
+	if (buf->map_size < TERM_FILE_HEADER_SIZE
+			|| memcmp(ptr, TERM_FILE_MAGIC, 8) != 0) {
+		goto invalid;
+	}
+	ptr += 8;
+
+	memcpy(&nrow, ptr, sizeof(nrow)); ptr += sizeof(nrow);
+	memcpy(&ncol, ptr, sizeof(ncol)); ptr += sizeof(ncol);
+	memcpy(&nz, ptr, sizeof(nz)); ptr += sizeof(nz);
+	memcpy(&nchunk, ptr, sizeof(nchunk)); ptr += sizeof(nchunk);
+	memcpy(&sorted, ptr, sizeof(sorted)); ptr += sizeof(sorted);
+
+	// each entry takes 16 bytes and each chunk 8 more; check the
+	// counts against the file size before allocating anything
+	if (nrow < 0 || nrow > INT32_MAX || ncol < 0 || ncol > INT32_MAX
+			|| nz < 0 || nchunk < 0
+			|| (uint64_t)nz > (size_t)(end - ptr) / 16
+			|| (uint64_t)nchunk > (size_t)(end - ptr) / 8) {
+		goto invalid;
+	}
+
+	if (nz > INT_MAX) {
+		error("number of non-zero entries (%"PRIu64") exceeds"
+		      " maximum (%d)", (uint64_t)nz, INT_MAX);
+	}
+
+	if (XLENGTH(scol_names) != ncol) {
+		error("column dictionary does not match term matrix file '%s'",
+		      CHAR(STRING_ELT(sfile, 0)));
+	}
+
+	if (srow_names != R_NilValue && XLENGTH(srow_names) != nrow) {
+		error("row names do not match term matrix file '%s'",
+		      CHAR(STRING_ELT(sfile, 0)));
+	}
+
+	rowptr = (void *)R_alloc(nrow + 1, sizeof(*rowptr));
+	memset(rowptr, 0, (nrow + 1) * sizeof(*rowptr));
+
+	if (term_file_scan(ptr, end, nchunk, nz, (int)nrow, (int)ncol,
+			   rowptr)) {
+		goto invalid;
+	}
+
+	for (i = 0; i < nrow; i++) {
+		rowptr[i + 1] += rowptr[i];
+	}
+
+	col_map = NULL;
+	if (sorted) {
+		PROTECT(scol_names = sort_names(scol_names, &col_map));
+		nprot++;
+	}
+
+	pos = (void *)R_alloc(nrow + 1, sizeof(*pos));
+	memcpy(pos, rowptr, (nrow + 1) * sizeof(*pos));
+	col = (void *)R_alloc(nz, sizeof(*col));
+	val = (void *)R_alloc(nz, sizeof(*val));
+	term_file_scatter(ptr, nchunk, col_map, pos, col, val);
+
+	// the row buckets are the columns of the transpose
+	PROTECT(si = allocVector(INTSXP, (R_xlen_t)nz)); nprot++;
+	PROTECT(sx = allocVector(REALSXP, (R_xlen_t)nz)); nprot++;
+	PROTECT(sdim = allocVector(INTSXP, 2)); nprot++;
+	PROTECT(sdimnames = allocVector(VECSXP, 2)); nprot++;
+
+	if (!transpose) {
+		PROTECT(sp = allocVector(INTSXP, ncol + 1)); nprot++;
+		transpose_csc((int)ncol, (int)nrow, rowptr, col, val,
+			      INTEGER(sp), INTEGER(si), REAL(sx));
+
+		INTEGER(sdim)[0] = (int)nrow;
+		INTEGER(sdim)[1] = (int)ncol;
+		SET_VECTOR_ELT(sdimnames, 0, srow_names);
+		SET_VECTOR_ELT(sdimnames, 1, scol_names);
+	} else {
+		colptr = (void *)R_alloc(ncol + 1, sizeof(*colptr));
+		row = (void *)R_alloc(nz, sizeof(*row));
+		cval = (void *)R_alloc(nz, sizeof(*cval));
+		transpose_csc((int)ncol, (int)nrow, rowptr, col, val, colptr,
+			      row, cval);
+
+		PROTECT(sp = allocVector(INTSXP, nrow + 1)); nprot++;
+		transpose_csc((int)nrow, (int)ncol, colptr, row, cval,
+			      INTEGER(sp), INTEGER(si), REAL(sx));
+
+		INTEGER(sdim)[0] = (int)ncol;
+		INTEGER(sdim)[1] = (int)nrow;
+		SET_VECTOR_ELT(sdimnames, 0, scol_names);
+		SET_VECTOR_ELT(sdimnames, 1, srow_names);
+	}
+
+	PROTECT(ans = NEW_OBJECT(MAKE_CLASS("dgCMatrix"))); nprot++;
+	SET_SLOT(ans, install("i"), si);
+	SET_SLOT(ans, install("p"), sp);
+	SET_SLOT(ans, install("x"), sx);
+	SET_SLOT(ans, install("Dim"), sdim);
+	SET_SLOT(ans, install("Dimnames"), sdimnames);
+
+	UNPROTECT(nprot);
+	return ans;
+
+invalid:
+	error("file '%s' is not a valid term matrix file",
+	      CHAR(STRING_ELT(sfile, 0)));
+	return R_NilValue;
+}
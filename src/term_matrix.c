@@ -20,22 +20,50 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "rcorpus.h"
 
 
-struct context {
-	struct utf8lite_render render;
+struct worker {
+	struct text_filter_copy copy;
+	struct corpus_filter *filter;
+	struct stemmer *stemmer;
+	const struct termset *select;
 	struct corpus_termset termset;
 	struct corpus_ngram *ngram;
 	int *buffer;
-	int *ngram_set;
-	int has_render, has_termset;
+	R_xlen_t group_begin, group_end;
+	size_t *term_nz;
+	size_t *term_pos;
+	int *term_map;
+	size_t nz;
+	int nterm, nterm_max;
+	int integer;
+	int has_copy, has_termset;
 	R_xlen_t has_ngram;
+	int error;
+};
+
+
+struct context {
+	struct utf8lite_render render;
+	struct corpus_termset termset;
+	struct corpus_symtab symtab;
+	struct stem_pool pool;
+	struct worker *worker;
+	int *ngram_set;
+	int ngram_max;
+	int nworker;
+	int integer;
+	int has_render, has_termset, has_symtab, has_pool, has_worker;
 };
 
 
 static void context_init(struct context *ctx, SEXP sngrams,
-			 const struct termset *select, R_xlen_t ngroup)
+			 const struct termset *select, int nworker,
+			 int integer)
 {
 	const int *ngrams;
 	R_xlen_t i, n;
@@ -61,7 +89,8 @@ static void context_init(struct context *ctx, SEXP sngrams,
 		ngram_max = select ? select->max_length : 1;
 	}
 
-	ctx->buffer = (void *)R_alloc(ngram_max, sizeof(*ctx->buffer));
+	ctx->ngram_max = ngram_max;
+	ctx->integer = integer;
 	ctx->ngram_set = (void *)R_alloc(ngram_max + 1,
 					 sizeof(*ctx->ngram_set));
 	memset(ctx->ngram_set, 0, (ngram_max + 1) * sizeof(*ctx->ngram_set));
@@ -76,59 +105,661 @@ static void context_init(struct context *ctx, SEXP sngrams,
 		}
 	}
 
-	if (ngroup > 0) {
-		TRY_ALLOC(ctx->ngram = corpus_malloc(ngroup
-					             * sizeof(*ctx->ngram)));
-	}
+	// with multiple workers, the worker terms get merged into a
+	// common set; a single worker's terms get used directly
+	if (!select && nworker > 1) {
+		TRY(corpus_termset_init(&ctx->termset));
+		ctx->has_termset = 1;
 
-	while (ctx->has_ngram < ngroup) {
-		TRY(corpus_ngram_init(&ctx->ngram[ctx->has_ngram], ngram_max));
-		ctx->has_ngram++;
+		TRY(corpus_symtab_init(&ctx->symtab, 0));
+		ctx->has_symtab = 1;
 	}
 
-	if (!select) {
-		TRY(corpus_termset_init(&ctx->termset));
-		ctx->has_termset = 1;
+	if (nworker > 1) {
+		TRY(stem_pool_init(&ctx->pool, nworker));
+		ctx->has_pool = 1;
 	}
+
+	TRY_ALLOC(ctx->worker = corpus_calloc(nworker, sizeof(*ctx->worker)));
+	ctx->nworker = nworker;
 out:
 	CHECK_ERROR(err);
 }
 
 
+static void worker_destroy(struct worker *w)
+{
+	while (w->has_ngram-- > 0) {
+		corpus_ngram_destroy(&w->ngram[w->has_ngram]);
+	}
+	corpus_free(w->ngram);
+
+	if (w->has_termset) {
+		corpus_termset_destroy(&w->termset);
+	}
+
+	corpus_free(w->term_nz);
+
+	if (w->has_copy) {
+		text_filter_copy_destroy(&w->copy);
+	}
+}
+
+
 static void context_destroy(void *obj)
 {
 	struct context *ctx = obj;
 
+	while (ctx->has_worker-- > 0) {
+		worker_destroy(&ctx->worker[ctx->has_worker]);
+	}
+	corpus_free(ctx->worker);
+
 	if (ctx->has_render) {
 		utf8lite_render_destroy(&ctx->render);
 	}
 
+	if (ctx->has_symtab) {
+		corpus_symtab_destroy(&ctx->symtab);
+	}
+
 	if (ctx->has_termset) {
 		corpus_termset_destroy(&ctx->termset);
 	}
 
-	while (ctx->has_ngram-- > 0) {
-		corpus_ngram_destroy(&ctx->ngram[ctx->has_ngram]);
+	if (ctx->has_pool) {
+		stem_pool_destroy(&ctx->pool);
+	}
+}
+
+
+/*
+ * Split the groups into contiguous ranges, one per worker, with roughly
+ * equal numbers of text bytes in each range.
+ */
+static void context_partition(struct context *ctx,
+			      const struct utf8lite_text *text,
+			      const int *group, R_xlen_t n, R_xlen_t ngroup)
+{
+	double *size, total, part;
+	R_xlen_t i, g;
+	int w;
+
+	if (ctx->nworker == 1) {
+		ctx->worker[0].group_begin = 0;
+		ctx->worker[0].group_end = ngroup;
+		return;
 	}
 
-	corpus_free(ctx->ngram);
+	size = (void *)R_alloc(ngroup, sizeof(*size));
+	for (g = 0; g < ngroup; g++) {
+		size[g] = 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!group) {
+			g = i;
+		} else if (group[i] == NA_INTEGER) {
+			continue;
+		} else {
+			g = (R_xlen_t)(group[i] - 1);
+		}
+		size[g] += (double)UTF8LITE_TEXT_SIZE(&text[i]);
+	}
+
+	total = 0;
+	for (g = 0; g < ngroup; g++) {
+		total += size[g];
+	}
+
+	g = 0;
+	part = 0;
+	for (w = 0; w < ctx->nworker; w++) {
+		ctx->worker[w].group_begin = g;
+		if (w + 1 == ctx->nworker) {
+			g = ngroup;
+		} else {
+			while (g < ngroup
+				&& part + size[g] <= total * (w + 1)
+							/ ctx->nworker) {
+				part += size[g];
+				g++;
+			}
+		}
+		ctx->worker[w].group_end = g;
+	}
+}
+
+
+static void context_start_workers(struct context *ctx, SEXP stext,
+				  struct corpus_filter *filter, SEXP sselect,
+				  const struct termset *select, SEXP protect)
+{
+	struct worker *w;
+	SEXP swselect;
+	R_xlen_t ngroup;
+	int err = 0, i;
+
+	for (i = 0; i < ctx->nworker; i++) {
+		w = &ctx->worker[i];
+		ctx->has_worker = i + 1;
+
+		w->integer = ctx->integer;
+		w->buffer = (void *)R_alloc(ctx->ngram_max,
+					    sizeof(*w->buffer));
+
+		ngroup = w->group_end - w->group_begin;
+		if (ngroup > 0) {
+			TRY_ALLOC(w->ngram = corpus_malloc(
+						ngroup * sizeof(*w->ngram)));
+		}
+
+		while (w->has_ngram < ngroup) {
+			TRY(corpus_ngram_init(&w->ngram[w->has_ngram],
+					      ctx->ngram_max));
+			w->has_ngram++;
+		}
+
+		if (!select) {
+			TRY(corpus_termset_init(&w->termset));
+			w->has_termset = 1;
+		}
+
+		// the first worker uses the text's own (warm) filter
+		if (i == 0) {
+			w->filter = filter;
+			w->stemmer = text_stemmer(stext);
+			w->select = select;
+			if (ctx->has_pool) {
+				stem_pool_add(&ctx->pool, w->stemmer);
+			}
+			continue;
+		}
+
+		// set first so a partial copy gets destroyed on error
+		w->has_copy = 1;
+		text_filter_copy_init(&w->copy, stext);
+		w->filter = &w->copy.filter;
+		w->stemmer = &w->copy.stemmer;
+		stem_pool_add(&ctx->pool, w->stemmer);
+
+		// term IDs agree across workers since 'select' has no
+		// duplicates
+		if (select) {
+			swselect = alloc_termset(sselect, "select",
+						 w->filter, 0);
+			SET_VECTOR_ELT(protect, i, swselect);
+			w->select = as_termset(swselect);
+		}
+	}
+out:
+	CHECK_ERROR(err);
 }
 
 
-SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
+/* make room to count the entries for terms 0, ..., 'nterm' - 1 */
+static int worker_grow(struct worker *w, int nterm)
+{
+	void *base = w->term_nz;
+	int size = w->nterm_max;
+	int err = 0;
+
+	if (nterm > size) {
+		TRY(corpus_array_grow(&base, &size, sizeof(*w->term_nz),
+				      w->nterm_max, nterm - w->nterm_max));
+		w->term_nz = base;
+		memset(w->term_nz + w->nterm_max, 0,
+		       (size_t)(size - w->nterm_max) * sizeof(*w->term_nz));
+		w->nterm_max = size;
+	}
+
+	if (nterm > w->nterm) {
+		w->nterm = nterm;
+	}
+out:
+	return err;
+}
+
+
+/* no R API calls allowed; this may run on a worker thread */
+static int worker_add(struct worker *w, const struct utf8lite_text *text,
+		      R_xlen_t g)
+{
+	struct corpus_filter *filter = w->filter;
+	struct corpus_ngram *ngram = &w->ngram[g - w->group_begin];
+	int err = 0, type_id;
+
+	TRY(corpus_filter_start(filter, text));
+
+	while (corpus_filter_advance(filter)) {
+		type_id = filter->type_id;
+		if (type_id == CORPUS_TYPE_NONE) {
+			continue;
+		} else if (type_id < 0) {
+			TRY(corpus_ngram_break(ngram));
+			continue;
+		}
+
+		TRY(corpus_ngram_add(ngram, type_id, 1));
+	}
+	TRY(filter->error);
+
+	TRY(corpus_ngram_break(ngram));
+out:
+	return err;
+}
+
+
+/*
+ * Walk the n-grams for the worker's groups, assigning term IDs and
+ * counting the entries for each term. Nothing else gets stored; the
+ * entries get filled in by a second walk, once the column offsets
+ * are known.
+ */
+static int worker_collect(struct worker *w, const int *ngram_set)
+{
+	struct corpus_ngram_iter it;
+	R_xlen_t g, ngroup;
+	int err = 0, term_id;
+
+	ngroup = w->group_end - w->group_begin;
+
+	for (g = 0; g < ngroup; g++) {
+		corpus_ngram_iter_make(&it, &w->ngram[g], w->buffer);
+		while (corpus_ngram_iter_advance(&it)) {
+			if (!ngram_set[it.length]) {
+				continue;
+			}
+
+			if (w->select) {
+				if (!corpus_termset_has(&w->select->set,
+							it.type_ids,
+							it.length, &term_id)) {
+					continue;
+				}
+			} else {
+				TRY(corpus_termset_add(&w->termset,
+						       it.type_ids,
+						       it.length, &term_id));
+			}
+
+			if (w->integer && it.weight > INT_MAX) {
+				TRY(CORPUS_ERROR_OVERFLOW);
+			}
+
+			TRY(worker_grow(w, term_id + 1));
+			w->term_nz[term_id]++;
+			w->nz++;
+		}
+	}
+out:
+	return err;
+}
+
+
+/* runs on a worker thread */
+static void worker_run(struct worker *w, const struct utf8lite_text *text,
+		       R_xlen_t n, const int *group, const int *ngram_set)
+{
+	R_xlen_t i, begin, end, g;
+	int err = 0;
+
+	begin = group ? 0 : w->group_begin;
+	end = group ? n : w->group_end;
+
+	for (i = begin; i < end; i++) {
+		if (!group) {
+			g = i;
+		} else if (group[i] == NA_INTEGER) {
+			continue;
+		} else {
+			g = (R_xlen_t)(group[i] - 1);
+			if (g < w->group_begin || g >= w->group_end) {
+				continue;
+			}
+		}
+
+		TRY(worker_add(w, &text[i], g));
+	}
+
+	TRY(worker_collect(w, ngram_set));
+out:
+	w->error = err;
+}
+
+
+/*
+ * Translate the worker-local term IDs to IDs in the context's term set.
+ */
+static void context_merge(struct context *ctx)
+{
+	struct worker *w;
+	int err = 0, i;
+
+	for (i = 0; i < ctx->nworker; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		w = &ctx->worker[i];
+		if (w->select) {
+			continue;
+		}
+
+		w->term_map = (void *)R_alloc(w->termset.nitem,
+					      sizeof(*w->term_map));
+		TRY(termset_merge(&ctx->termset, &ctx->symtab, &w->termset,
+				  &w->filter->symtab, w->term_map));
+	}
+out:
+	CHECK_ERROR(err);
+}
+
+
+struct name_index {
+	const char *name;
+	int index;
+};
+
+
+static int name_index_cmp(const void *x1, const void *x2)
+{
+	const struct name_index *a = x1;
+	const struct name_index *b = x2;
+	int cmp;
+
+	// byte order for UTF-8 strings, the same as order(method = "radix")
+	cmp = strcmp(a->name, b->name);
+	if (cmp == 0) {
+		cmp = (a->index > b->index) - (a->index < b->index);
+	}
+	return cmp;
+}
+
+
+/*
+ * Sort a character vector, returning the sorted copy and setting
+ * '*mapptr' to the position of each original element in the result.
+ */
+SEXP sort_names(SEXP snames, int **mapptr)
+{
+	SEXP ans;
+	struct name_index *items;
+	int *map;
+	R_xlen_t i, n = XLENGTH(snames);
+
+	items = (void *)R_alloc(n, sizeof(*items));
+	for (i = 0; i < n; i++) {
+		items[i].name = CHAR(STRING_ELT(snames, i));
+		items[i].index = (int)i;
+	}
+
+	qsort(items, n, sizeof(*items), name_index_cmp);
+
+	map = (void *)R_alloc(n, sizeof(*map));
+	PROTECT(ans = allocVector(STRSXP, n));
+	for (i = 0; i < n; i++) {
+		SET_STRING_ELT(ans, i, STRING_ELT(snames, items[i].index));
+		map[items[i].index] = (int)i;
+	}
+	UNPROTECT(1);
+
+	*mapptr = map;
+	return ans;
+}
+
+
+static int worker_col(const struct worker *w, int term_id,
+		      const int *col_map)
+{
+	int col = w->term_map ? w->term_map[term_id] : term_id;
+	return col_map ? col_map[col] : col;
+}
+
+
+/*
+ * Set the column pointers from the worker counts, and give each worker
+ * the offset of its first entry in each column. Later workers have
+ * later groups, so their entries go after the earlier ones.
+ */
+static void context_offsets(struct context *ctx, int ncol,
+			    const int *col_map, size_t *colptr)
+{
+	struct worker *w;
+	size_t *pos;
+	int col, j, t;
+
+	memset(colptr, 0, ((size_t)ncol + 1) * sizeof(*colptr));
+
+	for (j = 0; j < ctx->nworker; j++) {
+		w = &ctx->worker[j];
+		for (t = 0; t < w->nterm; t++) {
+			colptr[worker_col(w, t, col_map) + 1] += w->term_nz[t];
+		}
+	}
+
+	for (col = 0; col < ncol; col++) {
+		colptr[col + 1] += colptr[col];
+	}
+
+	pos = (void *)R_alloc((size_t)ncol + 1, sizeof(*pos));
+	memcpy(pos, colptr, ((size_t)ncol + 1) * sizeof(*pos));
+
+	for (j = 0; j < ctx->nworker; j++) {
+		w = &ctx->worker[j];
+		w->term_pos = (void *)R_alloc(w->nterm, sizeof(*w->term_pos));
+		for (t = 0; t < w->nterm; t++) {
+			col = worker_col(w, t, col_map);
+			w->term_pos[t] = pos[col];
+			pos[col] += w->term_nz[t];
+		}
+	}
+}
+
+
+/*
+ * The destination for the matrix entries, in column-major order. Either
+ * 'row' (compressed) or 'drow' and 'col' (triplets) get set, and either
+ * 'val' or 'ival'.
+ */
+struct entries {
+	int *row;
+	double *drow;
+	int *col;
+	double *val;
+	int *ival;
+	const int *col_map;
+};
+
+
+/*
+ * Walk the n-grams for the worker's groups again, in the same order as
+ * worker_collect(), writing each entry at its place in the output. The
+ * rows within each column come out sorted, as "dgCMatrix" requires.
+ *
+ * no R API calls allowed; this may run on a worker thread
+ */
+static void worker_fill(struct worker *w, const int *ngram_set,
+			const struct entries *e)
+{
+	struct corpus_ngram_iter it;
+	const struct corpus_termset *terms;
+	R_xlen_t g, ngroup;
+	size_t off;
+	int term_id;
+
+	terms = w->select ? &w->select->set : &w->termset;
+	ngroup = w->group_end - w->group_begin;
+
+	for (g = 0; g < ngroup; g++) {
+		corpus_ngram_iter_make(&it, &w->ngram[g], w->buffer);
+		while (corpus_ngram_iter_advance(&it)) {
+			if (!ngram_set[it.length]) {
+				continue;
+			}
+
+			if (!corpus_termset_has(terms, it.type_ids, it.length,
+						&term_id)) {
+				continue;
+			}
+
+			off = w->term_pos[term_id]++;
+			if (e->row) {
+				e->row[off] = (int)(w->group_begin + g);
+			} else {
+				e->drow[off] = (double)(w->group_begin + g);
+				e->col[off] = worker_col(w, term_id,
+							 e->col_map);
+			}
+			if (e->ival) {
+				e->ival[off] = (int)it.weight;
+			} else {
+				e->val[off] = it.weight;
+			}
+		}
+	}
+}
+
+
+static void context_fill(struct context *ctx, const struct entries *e)
+{
+	int j, nworker = ctx->nworker;
+
+	if (nworker > 1) {
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nworker)
+#endif
+		for (j = 0; j < nworker; j++) {
+			worker_fill(&ctx->worker[j], ctx->ngram_set, e);
+		}
+	} else {
+		worker_fill(&ctx->worker[0], ctx->ngram_set, e);
+	}
+}
+
+
+/*
+ * Transpose a CSC matrix. Walking the columns in order leaves the row
+ * indices of the result sorted.
+ */
+void transpose_csc(int nrow, int ncol, const int *colptr, const int *row,
+		   const double *val, int *tcolptr, int *trow, double *tval)
+{
+	int *pos;
+	int i, j, k, off;
+
+	memset(tcolptr, 0, (nrow + 1) * sizeof(*tcolptr));
+
+	for (k = 0; k < colptr[ncol]; k++) {
+		tcolptr[row[k] + 1]++;
+	}
+
+	for (i = 0; i < nrow; i++) {
+		tcolptr[i + 1] += tcolptr[i];
+	}
+
+	pos = (void *)R_alloc(nrow + 1, sizeof(*pos));
+	memcpy(pos, tcolptr, (nrow + 1) * sizeof(*pos));
+
+	for (j = 0; j < ncol; j++) {
+		for (k = colptr[j]; k < colptr[j + 1]; k++) {
+			off = pos[row[k]]++;
+			trow[off] = j;
+			tval[off] = val[k];
+		}
+	}
+}
+
+
+static SEXP context_dgcmatrix(struct context *ctx, R_xlen_t nrow,
+			      int ncol, const size_t *colptr, int transpose,
+			      SEXP srow_names, SEXP scol_names)
+{
+	SEXP ans, sp, si, sx, sdim, sdimnames;
+	struct entries e;
+	int *icolptr;
+	size_t nz = colptr[ncol];
+	int col;
+
+	if (nrow > INT_MAX) {
+		error("number of rows (%"PRIu64") exceeds maximum (%d)",
+		      (uint64_t)nrow, INT_MAX);
+	}
+
+	if (nz > INT_MAX) {
+		error("number of non-zero entries (%"PRIu64") exceeds"
+		      " maximum (%d)", (uint64_t)nz, INT_MAX);
+	}
+
+	PROTECT(si = allocVector(INTSXP, nz));
+	PROTECT(sx = allocVector(REALSXP, nz));
+	PROTECT(sdim = allocVector(INTSXP, 2));
+	PROTECT(sdimnames = allocVector(VECSXP, 2));
+
+	memset(&e, 0, sizeof(e));
+
+	if (!transpose) {
+		PROTECT(sp = allocVector(INTSXP, ncol + 1));
+		icolptr = INTEGER(sp);
+		e.row = INTEGER(si);
+		e.val = REAL(sx);
+	} else {
+		icolptr = (void *)R_alloc(ncol + 1, sizeof(*icolptr));
+		e.row = (void *)R_alloc(nz, sizeof(*e.row));
+		e.val = (void *)R_alloc(nz, sizeof(*e.val));
+	}
+
+	for (col = 0; col <= ncol; col++) {
+		icolptr[col] = (int)colptr[col];
+	}
+	context_fill(ctx, &e);
+
+	if (!transpose) {
+		INTEGER(sdim)[0] = (int)nrow;
+		INTEGER(sdim)[1] = ncol;
+		SET_VECTOR_ELT(sdimnames, 0, srow_names);
+		SET_VECTOR_ELT(sdimnames, 1, scol_names);
+	} else {
+		PROTECT(sp = allocVector(INTSXP, nrow + 1));
+		transpose_csc((int)nrow, ncol, icolptr, e.row, e.val,
+			      INTEGER(sp), INTEGER(si), REAL(sx));
+
+		INTEGER(sdim)[0] = ncol;
+		INTEGER(sdim)[1] = (int)nrow;
+		SET_VECTOR_ELT(sdimnames, 0, scol_names);
+		SET_VECTOR_ELT(sdimnames, 1, srow_names);
+	}
+
+	PROTECT(ans = NEW_OBJECT(MAKE_CLASS("dgCMatrix")));
+	SET_SLOT(ans, install("i"), si);
+	SET_SLOT(ans, install("p"), sp);
+	SET_SLOT(ans, install("x"), sx);
+	SET_SLOT(ans, install("Dim"), sdim);
+	SET_SLOT(ans, install("Dimnames"), sdimnames);
+
+	UNPROTECT(6);
+	return ans;
+}
+
+
+SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup,
+		 SEXP sinteger, SEXP sthreads, SEXP scompress,
+		 SEXP stranspose)
 {
 	SEXP ans = R_NilValue, sctx, snames, si, sj, scount, stext,
-	     scol_names, srow_names, sterm;
+	     scol_names, srow_names, sterm, sprotect;
 	struct context *ctx;
 	const struct utf8lite_text *text, *type;
+	const struct corpus_symtab_type *types;
 	struct corpus_filter *filter;
 	const struct termset *select;
 	const struct corpus_termset *terms;
 	const int *type_ids;
 	const int *group;
-	struct corpus_ngram_iter it;
-	R_xlen_t i, n, g, ngroup, nz, off;
-	int err = 0, j, m, term_id, type_id, nprot = 0;
+	int *col_map;
+	struct worker *w;
+	struct entries e;
+	size_t *colptr;
+	R_xlen_t i, n, g, ngroup, nz;
+	int err = 0, j, m, integer, nworker, nprot = 0;
 
 	PROTECT(stext = coerce_text(sx)); nprot++;
 	text = as_text(stext, &n);
@@ -156,95 +787,78 @@ SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
 		group = NULL;
 	}
 
-	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
-        ctx = as_context(sctx);
-	context_init(ctx, sngrams, select, ngroup);
+	integer = (LOGICAL(sinteger)[0] == TRUE);
 
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
+	nworker = 1;
+	if (text_filter_threadsafe(stext)) {
+		nworker = thread_count(sthreads, ngroup);
+	}
 
-		if (!group) {
-			g = i;
-		} else if (group[i] == NA_INTEGER) {
-			continue;
-		} else {
-			assert(0 < group[i] && group[i] <= ngroup);
-			g = (R_xlen_t)(group[i] - 1);
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+        ctx = as_context(sctx);
+	context_init(ctx, sngrams, select, nworker, integer);
+
+	PROTECT(sprotect = allocVector(VECSXP, nworker)); nprot++;
+	context_partition(ctx, text, group, n, ngroup);
+	context_start_workers(ctx, stext, filter, sselect, select, sprotect);
+
+	if (nworker > 1) {
+		stem_pool_attach(&ctx->pool);
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nworker)
+#endif
+		for (j = 0; j < nworker; j++) {
+			worker_run(&ctx->worker[j], text, n, group,
+				   ctx->ngram_set);
 		}
+		stem_pool_detach(&ctx->pool);
 
-		TRY(corpus_filter_start(filter, &text[i]));
-
-		while (corpus_filter_advance(filter)) {
-			type_id = filter->type_id;
-			if (type_id == CORPUS_TYPE_NONE) {
-				continue;
-			} else if (type_id < 0) {
-				TRY(corpus_ngram_break(&ctx->ngram[g]));
-				continue;
-			}
-
-			TRY(corpus_ngram_add(&ctx->ngram[g], type_id, 1));
+		for (j = 0; j < nworker; j++) {
+			TRY(ctx->worker[j].error);
 		}
-		TRY(filter->error);
-
-		TRY(corpus_ngram_break(&ctx->ngram[g]));
-	}
 
-	nz = 0;
+		context_merge(ctx);
+	} else {
+		w = &ctx->worker[0];
 
-	for (g = 0; g < ngroup; g++) {
-		RCORPUS_CHECK_INTERRUPT(g);
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
 
-		corpus_ngram_iter_make(&it, &ctx->ngram[g], ctx->buffer);
-		while (corpus_ngram_iter_advance(&it)) {
-			if (!ctx->ngram_set[it.length]) {
+			if (!group) {
+				g = i;
+			} else if (group[i] == NA_INTEGER) {
 				continue;
-			}
-
-			if (select) {
-			       if (!corpus_termset_has(&select->set,
-						       it.type_ids,
-						       it.length, NULL)) {
-				       continue;
-			       }
 			} else {
-				TRY(corpus_termset_add(&ctx->termset,
-						       it.type_ids,
-						       it.length, NULL));
+				assert(0 < group[i] && group[i] <= ngroup);
+				g = (R_xlen_t)(group[i] - 1);
 			}
 
-			TRY(nz == R_XLEN_T_MAX ? CORPUS_ERROR_OVERFLOW : 0);
-			nz++;
+			TRY(worker_add(w, &text[i], g));
 		}
-	}
 
-	PROTECT(si = allocVector(REALSXP, nz)); nprot++;
-	PROTECT(sj = allocVector(INTSXP, nz)); nprot++;
-	PROTECT(scount = allocVector(REALSXP, nz)); nprot++;
-
-	off = 0;
-	terms = select ? &select->set : &ctx->termset;
-	for (g = 0; g < ngroup; g++) {
-		RCORPUS_CHECK_INTERRUPT(g);
+		TRY(worker_collect(w, ctx->ngram_set));
+	}
 
-		corpus_ngram_iter_make(&it, &ctx->ngram[g], ctx->buffer);
-		while (corpus_ngram_iter_advance(&it)) {
-			if (!ctx->ngram_set[it.length]) {
-				continue;
-			}
+	nz = 0;
 
-			if (!corpus_termset_has(terms, it.type_ids,
-						it.length, &term_id)) {
-				continue;
-			}
+	for (j = 0; j < nworker; j++) {
+		w = &ctx->worker[j];
+		TRY((size_t)(R_XLEN_T_MAX - nz) < w->nz
+		    ? CORPUS_ERROR_OVERFLOW : 0);
+		nz += (R_xlen_t)w->nz;
+	}
 
-			REAL(si)[off] = (double)g;
-			INTEGER(sj)[off] = term_id;
-			REAL(scount)[off] = it.weight;
-			off++;
-		}
+	if (select) {
+		terms = &select->set;
+	} else if (ctx->has_termset) {
+		terms = &ctx->termset;
+	} else {
+		terms = &ctx->worker[0].termset;
 	}
 
+	// merged terms refer to the context's symbol table
+	types = ctx->has_symtab ? ctx->symtab.types : filter->symtab.types;
+
 	PROTECT(scol_names = allocVector(STRSXP, terms->nitem));
 	nprot++;
 
@@ -255,7 +869,7 @@ SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
 		m = terms->items[i].length;
 
 		for (j = 0; j < m; j++) {
-			type = &filter->symtab.types[type_ids[j]].text;
+			type = &types[type_ids[j]].text;
 			if (j > 0) {
 				utf8lite_render_char(&ctx->render, ' ');
 			}
@@ -270,6 +884,45 @@ SEXP term_matrix(SEXP sx, SEXP sngrams, SEXP sselect, SEXP sgroup)
 		SET_STRING_ELT(scol_names, i, sterm);
 	}
 
+	// put the terms in lexicographic order, unless they come from
+	// 'select'
+	col_map = NULL;
+	if (!select) {
+		PROTECT(scol_names = sort_names(scol_names, &col_map));
+		nprot++;
+	}
+
+	colptr = (void *)R_alloc((size_t)terms->nitem + 1, sizeof(*colptr));
+	context_offsets(ctx, terms->nitem, col_map, colptr);
+
+	if (LOGICAL(scompress)[0] == TRUE) {
+		PROTECT(ans = context_dgcmatrix(ctx, ngroup, terms->nitem,
+						colptr,
+						LOGICAL(stranspose)[0] == TRUE,
+						srow_names, scol_names));
+		nprot++;
+		goto out;
+	}
+
+	PROTECT(si = allocVector(REALSXP, nz)); nprot++;
+	PROTECT(sj = allocVector(INTSXP, nz)); nprot++;
+	if (integer) {
+		PROTECT(scount = allocVector(INTSXP, nz)); nprot++;
+	} else {
+		PROTECT(scount = allocVector(REALSXP, nz)); nprot++;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.drow = REAL(si);
+	e.col = INTEGER(sj);
+	if (integer) {
+		e.ival = INTEGER(scount);
+	} else {
+		e.val = REAL(scount);
+	}
+	e.col_map = col_map;
+	context_fill(ctx, &e);
+
 	PROTECT(ans = allocVector(VECSXP, 5)); nprot++;
 	SET_VECTOR_ELT(ans, 0, si);
 	SET_VECTOR_ELT(ans, 1, sj);
@@ -20,25 +20,143 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "rcorpus.h"
 
+// number of lines to batch together for a vectorized R stemmer
+#define STATS_NDJSON_BLOCK 4096
+
+
+/* term counts and supports, stored as doubles or as integers */
+struct table {
+	double *count;
+	double *support;
+	int *icount;
+	int *isupport;
+	int integer;
+};
+
+
+struct worker {
+	struct text_filter_copy copy;
+	struct corpus_filter *filter;
+	struct stemmer *stemmer;
+	struct corpus_ngram ngram;
+	struct corpus_termset termset;
+	const int *ngram_set;
+	int *buffer;
+	struct table table;
+	int *term_map;
+	R_xlen_t begin, end;
+	int has_copy, has_ngram, has_termset;
+	int error;
+};
+
 
 struct context {
 	int ngram_max;
-	int *buffer;
 	int *ngram_set;
-	double *support;
-	double *count;
+	struct table table;
 	struct utf8lite_render render;
-	struct corpus_ngram ngram;
 	struct corpus_termset termset;
+	struct corpus_symtab symtab;
+	struct stem_pool pool;
+	struct worker *worker;
+	int nworker;
+	int has_pool;
 	int has_render;
-	int has_ngram;
 	int has_termset;
+	int has_symtab;
+	int has_worker;
 };
 
 
-static void context_init(struct context *ctx, SEXP sngrams)
+static void table_destroy(struct table *t)
+{
+	corpus_free(t->isupport);
+	corpus_free(t->icount);
+	corpus_free(t->support);
+	corpus_free(t->count);
+}
+
+
+/*
+ * Grow the table capacity from 'size0' to 'size' entries, setting the
+ * new entries to zero.
+ */
+static int table_grow(struct table *t, int size0, int size)
+{
+	void *count, *support;
+	int err = 0, i;
+
+	if (t->integer) {
+		TRY_ALLOC(count = corpus_realloc(t->icount,
+						 size * sizeof(*t->icount)));
+		t->icount = count;
+
+		TRY_ALLOC(support = corpus_realloc(t->isupport, size
+						   * sizeof(*t->isupport)));
+		t->isupport = support;
+
+		for (i = size0; i < size; i++) {
+			t->icount[i] = 0;
+			t->isupport[i] = 0;
+		}
+	} else {
+		TRY_ALLOC(count = corpus_realloc(t->count,
+						 size * sizeof(*t->count)));
+		t->count = count;
+
+		TRY_ALLOC(support = corpus_realloc(t->support,
+						   size * sizeof(*t->support)));
+		t->support = support;
+
+		for (i = size0; i < size; i++) {
+			t->count[i] = 0;
+			t->support[i] = 0;
+		}
+	}
+out:
+	return err;
+}
+
+
+static int table_add(struct table *t, int id, double count, double support)
+{
+	int err = 0;
+
+	if (t->integer) {
+		TRY(count > INT_MAX - t->icount[id]
+		    ? CORPUS_ERROR_OVERFLOW : 0);
+		TRY(support > INT_MAX - t->isupport[id]
+		    ? CORPUS_ERROR_OVERFLOW : 0);
+		t->icount[id] += (int)count;
+		t->isupport[id] += (int)support;
+	} else {
+		t->count[id] += count;
+		t->support[id] += support;
+	}
+out:
+	return err;
+}
+
+
+static double table_count(const struct table *t, int id)
+{
+	return t->integer ? (double)t->icount[id] : t->count[id];
+}
+
+
+static double table_support(const struct table *t, int id)
+{
+	return t->integer ? (double)t->isupport[id] : t->support[id];
+}
+
+
+static void context_init(struct context *ctx, SEXP sngrams, int nworker,
+			 int integer)
 {
 	const int *ngrams;
 	int *ngram_set;
@@ -71,115 +189,286 @@ static void context_init(struct context *ctx, SEXP sngrams)
 
 	ctx->ngram_max = ngram_max;
 	ctx->ngram_set = ngram_set;
-	ctx->buffer = (void *)R_alloc(ngram_max, sizeof(*ctx->buffer));
+	ctx->table.integer = integer;
 
 	TRY(utf8lite_render_init(&ctx->render, UTF8LITE_ESCAPE_NONE));
 	ctx->has_render = 1;
 
-	TRY(corpus_ngram_init(&ctx->ngram, ngram_max));
-	ctx->has_ngram = 1;
+	TRY_ALLOC(ctx->worker = corpus_calloc(nworker, sizeof(*ctx->worker)));
+	ctx->nworker = nworker;
+
+	// with multiple workers, the counts get merged into a common set
+	if (nworker > 1) {
+		TRY(corpus_termset_init(&ctx->termset));
+		ctx->has_termset = 1;
+
+		TRY(corpus_symtab_init(&ctx->symtab, 0));
+		ctx->has_symtab = 1;
 
-	TRY(corpus_termset_init(&ctx->termset));
-	ctx->has_termset = 1;
+		TRY(stem_pool_init(&ctx->pool, nworker));
+		ctx->has_pool = 1;
+	}
 out:
 	CHECK_ERROR(err);
 }
 
 
+static void worker_destroy(struct worker *w)
+{
+	table_destroy(&w->table);
+
+	if (w->has_termset) {
+		corpus_termset_destroy(&w->termset);
+	}
+	if (w->has_ngram) {
+		corpus_ngram_destroy(&w->ngram);
+	}
+	if (w->has_copy) {
+		text_filter_copy_destroy(&w->copy);
+	}
+}
+
+
 static void context_destroy(void *obj)
 {
 	struct context *ctx = obj;
 
-	corpus_free(ctx->count);
-	corpus_free(ctx->support);
+	while (ctx->has_worker > 0) {
+		ctx->has_worker--;
+		worker_destroy(&ctx->worker[ctx->has_worker]);
+	}
+	corpus_free(ctx->worker);
+
+	table_destroy(&ctx->table);
 
+	if (ctx->has_symtab) {
+		corpus_symtab_destroy(&ctx->symtab);
+	}
 	if (ctx->has_termset) {
 		corpus_termset_destroy(&ctx->termset);
 	}
-	if (ctx->has_ngram) {
-		corpus_ngram_destroy(&ctx->ngram);
-	}
 	if (ctx->has_render) {
 		utf8lite_render_destroy(&ctx->render);
 	}
+	if (ctx->has_pool) {
+		stem_pool_destroy(&ctx->pool);
+	}
+}
+
+
+/*
+ * Split the texts into contiguous blocks, one per worker, with roughly
+ * equal numbers of bytes in each block.
+ */
+static void context_partition(struct context *ctx,
+			      const struct utf8lite_text *text, R_xlen_t n)
+{
+	double total, part, size;
+	R_xlen_t i;
+	int w;
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		total += 1 + (double)UTF8LITE_TEXT_SIZE(&text[i]);
+	}
+
+	i = 0;
+	part = 0;
+	for (w = 0; w < ctx->nworker; w++) {
+		ctx->worker[w].begin = i;
+		if (w + 1 == ctx->nworker) {
+			i = n;
+		} else {
+			while (i < n) {
+				size = 1 + (double)UTF8LITE_TEXT_SIZE(&text[i]);
+				if (part + size > total * (w + 1)
+						  / ctx->nworker) {
+					break;
+				}
+				part += size;
+				i++;
+			}
+		}
+		ctx->worker[w].end = i;
+	}
+}
+
+
+static void context_start_workers(struct context *ctx, SEXP stext,
+				  struct corpus_filter *filter)
+{
+	struct worker *w;
+	int err = 0, i;
+
+	for (i = 0; i < ctx->nworker; i++) {
+		w = &ctx->worker[i];
+		ctx->has_worker = i + 1;
+
+		w->ngram_set = ctx->ngram_set;
+		w->table.integer = ctx->table.integer;
+		w->buffer = (void *)R_alloc(ctx->ngram_max,
+					    sizeof(*w->buffer));
+
+		TRY(corpus_ngram_init(&w->ngram, ctx->ngram_max));
+		w->has_ngram = 1;
+
+		TRY(corpus_termset_init(&w->termset));
+		w->has_termset = 1;
+
+		// the first worker uses the text's own (warm) filter
+		if (i == 0) {
+			w->filter = filter;
+			w->stemmer = text_stemmer(stext);
+		} else {
+			// set first so a partial copy gets destroyed on error
+			w->has_copy = 1;
+			text_filter_copy_init(&w->copy, stext);
+			w->filter = &w->copy.filter;
+			w->stemmer = &w->copy.stemmer;
+		}
+
+		if (ctx->has_pool) {
+			stem_pool_add(&ctx->pool, w->stemmer);
+		}
+	}
+out:
+	CHECK_ERROR(err);
 }
 
 
-static void context_update(struct context *ctx, double weight)
+static int worker_update(struct worker *w, double weight)
 {
 	struct corpus_ngram_iter it;
-	size_t size;
-	double *count;
-	double *support;
-	int term_id = -1, nterm, nterm_max;
+	int term_id = -1, nterm_max;
 	int err = 0;
 
-	corpus_ngram_iter_make(&it, &ctx->ngram, ctx->buffer);
+	corpus_ngram_iter_make(&it, &w->ngram, w->buffer);
 	while (corpus_ngram_iter_advance(&it)) {
-		if (!ctx->ngram_set[it.length]) {
+		if (!w->ngram_set[it.length]) {
 			continue;
 		}
 
-		if (!corpus_termset_has(&ctx->termset, it.type_ids,
+		if (!corpus_termset_has(&w->termset, it.type_ids,
 					it.length, &term_id)) {
 
-			nterm = ctx->termset.nitem;
-			nterm_max = ctx->termset.nitem_max;
-			TRY(corpus_termset_add(&ctx->termset, it.type_ids,
+			nterm_max = w->termset.nitem_max;
+			TRY(corpus_termset_add(&w->termset, it.type_ids,
 					       it.length, &term_id));
 
-			if (ctx->termset.nitem_max != nterm_max) {
-				nterm_max = ctx->termset.nitem_max;
+			if (w->termset.nitem_max != nterm_max) {
+				TRY(table_grow(&w->table, nterm_max,
+					       w->termset.nitem_max));
+			}
+		}
+		TRY(table_add(&w->table, term_id, it.weight, weight));
+	}
+	corpus_ngram_clear(&w->ngram);
+out:
+	return err;
+}
+
 
-				size = nterm_max * sizeof(*count);
-				TRY_ALLOC(count
-					= corpus_realloc(ctx->count, size));
-				ctx->count = count;
+/* no R API calls allowed; this may run on a worker thread */
+static int worker_add(struct worker *w, const struct utf8lite_text *text)
+{
+	struct corpus_filter *filter = w->filter;
+	int err = 0, type_id;
 
-				size = nterm_max * sizeof(*support);
-				TRY_ALLOC(support
-					= corpus_realloc(ctx->support, size));
-				ctx->support = support;
-			}
-			while (nterm < ctx->termset.nitem) {
-				ctx->count[nterm] = 0;
-				ctx->support[nterm] = 0;
-				nterm++;
-			}
+	TRY(corpus_filter_start(filter, text));
+
+	while (corpus_filter_advance(filter)) {
+		type_id = filter->type_id;
+
+		if (type_id == CORPUS_TYPE_NONE) {
+			continue;
+		} else if (type_id < 0) {
+			TRY(corpus_ngram_break(&w->ngram));
+			continue;
+		}
+
+		TRY(corpus_ngram_add(&w->ngram, type_id, 1));
+	}
+	TRY(filter->error);
+
+	TRY(corpus_ngram_break(&w->ngram));
+	TRY(worker_update(w, 1));
+out:
+	return err;
+}
+
+
+/* runs on a worker thread */
+static void worker_run(struct worker *w, const struct utf8lite_text *text)
+{
+	R_xlen_t i;
+	int err = 0;
+
+	for (i = w->begin; i < w->end; i++) {
+		TRY(worker_add(w, &text[i]));
+	}
+out:
+	w->error = err;
+}
+
+
+/*
+ * Sum the worker counts and supports into the context's term set,
+ * processing the workers in order so that the term order matches the
+ * order from a single pass.
+ */
+static void context_merge(struct context *ctx)
+{
+	struct worker *w;
+	int err = 0, i, j, nterm, term_id;
+
+	nterm = 0;
+
+	for (i = 0; i < ctx->nworker; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		w = &ctx->worker[i];
+		w->term_map = (void *)R_alloc(w->termset.nitem,
+					      sizeof(*w->term_map));
+		TRY(termset_merge(&ctx->termset, &ctx->symtab, &w->termset,
+				  &w->filter->symtab, w->term_map));
+
+		if (ctx->termset.nitem > nterm) {
+			TRY(table_grow(&ctx->table, nterm,
+				       ctx->termset.nitem));
+			nterm = ctx->termset.nitem;
+		}
+
+		for (j = 0; j < w->termset.nitem; j++) {
+			term_id = w->term_map[j];
+			TRY(table_add(&ctx->table, term_id,
+				      table_count(&w->table, j),
+				      table_support(&w->table, j)));
 		}
-		ctx->count[term_id] += it.weight;
-		ctx->support[term_id] += weight;
 	}
-	corpus_ngram_clear(&ctx->ngram);
 out:
 	CHECK_ERROR(err);
 }
 
 
-SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
-		SEXP smin_support, SEXP smax_support, SEXP soutput_types)
+static SEXP context_stats(struct context *ctx,
+			  const struct corpus_termset *termset,
+			  const struct corpus_symtab_type *types,
+			  const struct table *table,
+			  SEXP smin_count, SEXP smax_count,
+			  SEXP smin_support, SEXP smax_support,
+			  SEXP soutput_types)
 {
-	SEXP ans, sctx, sterm, scount, ssupport, stext,
-	     sclass, snames, srow_names, stype = NA_STRING;
+	SEXP ans = R_NilValue, sterm, scount, ssupport, sclass, snames,
+	     srow_names, stype = NA_STRING;
 	SEXP *stypes;
-	struct context *ctx;
-	const struct utf8lite_text *text, *type = NULL;
+	const struct utf8lite_text *type = NULL;
 	const struct corpus_termset_term *term;
 	struct mkchar mkchar;
-	struct corpus_filter *filter;
 	double count, supp, min_count, max_count, min_support, max_support;
-	R_xlen_t i, n, iterm, nterm;
+	R_xlen_t i, iterm, nterm;
 	int output_types;
 	int off, len, j, type_id, err = 0, nprot = 0;
 
-	PROTECT(stext = coerce_text(sx)); nprot++;
-	text = as_text(stext, &n);
-	filter = text_filter(stext);
-
-	if (sngrams != R_NilValue) {
-		PROTECT(sngrams = coerceVector(sngrams, INTSXP)); nprot++;
-	}
-
 	min_count = smin_count == R_NilValue ? -INFINITY : REAL(smin_count)[0];
 	max_count = smax_count == R_NilValue ? INFINITY : REAL(smax_count)[0];
 
@@ -190,40 +479,13 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 
 	output_types = (LOGICAL(soutput_types)[0] == TRUE);
 
-	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
-        ctx = as_context(sctx);
-	context_init(ctx, sngrams);
-
-	for (i = 0; i < n; i++) {
-		RCORPUS_CHECK_INTERRUPT(i);
-
-		TRY(corpus_filter_start(filter, &text[i]));
-
-		while (corpus_filter_advance(filter)) {
-			type_id = filter->type_id;
-
-			if (type_id == CORPUS_TYPE_NONE) {
-				continue;
-			} else if (type_id < 0) {
-				TRY(corpus_ngram_break(&ctx->ngram));
-				continue;
-			}
-
-			TRY(corpus_ngram_add(&ctx->ngram, type_id, 1));
-		}
-		TRY(filter->error);
-
-		TRY(corpus_ngram_break(&ctx->ngram));
-		context_update(ctx, 1);
-	}
-
 	nterm = 0;
-	for (i = 0; i < ctx->termset.nitem; i++) {
+	for (i = 0; i < termset->nitem; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 
-		term = &ctx->termset.items[i];
-		count = ctx->count[i];
-		supp = ctx->support[i];
+		term = &termset->items[i];
+		count = table_count(table, i);
+		supp = table_support(table, i);
 
 		if (!(min_count <= count && count <= max_count)) {
 			continue;
@@ -256,18 +518,23 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 		stypes = NULL;
 	}
 
-	PROTECT(scount = allocVector(REALSXP, nterm)); nprot++;
-	PROTECT(ssupport = allocVector(REALSXP, nterm)); nprot++;
+	if (table->integer) {
+		PROTECT(scount = allocVector(INTSXP, nterm)); nprot++;
+		PROTECT(ssupport = allocVector(INTSXP, nterm)); nprot++;
+	} else {
+		PROTECT(scount = allocVector(REALSXP, nterm)); nprot++;
+		PROTECT(ssupport = allocVector(REALSXP, nterm)); nprot++;
+	}
 
 	mkchar_init(&mkchar);
 	iterm = 0;
 	
-	for (i = 0; i < ctx->termset.nitem; i++) {
+	for (i = 0; i < termset->nitem; i++) {
 		RCORPUS_CHECK_INTERRUPT(i);
 
-		term = &ctx->termset.items[i];
-		count = ctx->count[i];
-		supp = ctx->support[i];
+		term = &termset->items[i];
+		count = table_count(table, i);
+		supp = table_support(table, i);
 
 		if (!(min_count <= count && count <= max_count)) {
 			continue;
@@ -281,7 +548,7 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 
 		for (j = 0; j < term->length; j++) {
 			type_id = term->type_ids[j];
-			type = &filter->symtab.types[type_id].text;
+			type = &types[type_id].text;
 
 			if (output_types) {
 				stype = mkchar_get(&mkchar, type);
@@ -311,8 +578,13 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 			utf8lite_render_clear(&ctx->render);
 		}
 
-		REAL(scount)[iterm] = count;
-		REAL(ssupport)[iterm] = supp;
+		if (table->integer) {
+			INTEGER(scount)[iterm] = table->icount[i];
+			INTEGER(ssupport)[iterm] = table->isupport[i];
+		} else {
+			REAL(scount)[iterm] = count;
+			REAL(ssupport)[iterm] = supp;
+		}
 		iterm++;
 	}
 
@@ -359,6 +631,195 @@ SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
 	SET_STRING_ELT(sclass, 1, mkChar("data.frame"));
 	setAttrib(ans, R_ClassSymbol, sclass);
 
+out:
+	CHECK_ERROR(err);
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+SEXP term_stats(SEXP sx, SEXP sngrams, SEXP smin_count, SEXP smax_count,
+		SEXP smin_support, SEXP smax_support, SEXP soutput_types,
+		SEXP sinteger, SEXP sthreads)
+{
+	SEXP ans, sctx, stext;
+	struct context *ctx;
+	struct worker *w;
+	const struct utf8lite_text *text;
+	const struct corpus_termset *termset;
+	const struct corpus_symtab_type *types;
+	const struct table *table;
+	struct corpus_filter *filter;
+	R_xlen_t i, n;
+	int nworker;
+	int j, err = 0, nprot = 0;
+
+	PROTECT(stext = coerce_text(sx)); nprot++;
+	text = as_text(stext, &n);
+	filter = text_filter(stext);
+
+	if (sngrams != R_NilValue) {
+		PROTECT(sngrams = coerceVector(sngrams, INTSXP)); nprot++;
+	}
+
+	nworker = 1;
+	if (text_filter_threadsafe(stext)) {
+		nworker = thread_count(sthreads, n);
+	}
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+        ctx = as_context(sctx);
+	context_init(ctx, sngrams, nworker, LOGICAL(sinteger)[0] == TRUE);
+	context_partition(ctx, text, n);
+	context_start_workers(ctx, stext, filter);
+
+	if (nworker > 1) {
+		stem_pool_attach(&ctx->pool);
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(nworker)
+#endif
+		for (j = 0; j < nworker; j++) {
+			worker_run(&ctx->worker[j], text);
+		}
+		stem_pool_detach(&ctx->pool);
+
+		for (j = 0; j < nworker; j++) {
+			TRY(ctx->worker[j].error);
+		}
+
+		context_merge(ctx);
+
+		termset = &ctx->termset;
+		types = ctx->symtab.types;
+		table = &ctx->table;
+	} else {
+		w = &ctx->worker[0];
+
+		for (i = 0; i < n; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			TRY(worker_add(w, &text[i]));
+		}
+
+		termset = &w->termset;
+		types = filter->symtab.types;
+		table = &w->table;
+	}
+
+	PROTECT(ans = context_stats(ctx, termset, types, table, smin_count,
+				    smax_count, smin_support, smax_support,
+				    soutput_types)); nprot++;
+out:
+	CHECK_ERROR(err);
+        free_context(sctx);
+	UNPROTECT(nprot);
+	return ans;
+}
+
+
+static int stats_ndjson_block(struct worker *w, SEXP sbatch,
+			      const struct utf8lite_text *block, int nblock)
+{
+	int err = 0, i;
+
+	stem_batch_add(sbatch, block, nblock);
+
+	for (i = 0; i < nblock; i++) {
+		TRY(worker_add(w, &block[i]));
+	}
+out:
+	return err;
+}
+
+
+/*
+ * Compute the term statistics for one field of each row in an
+ * newline-delimited JSON file, one line at a time. The rows never get
+ * stored or typed, so the memory use is proportional to the number of
+ * distinct terms, not to the size of the file.
+ */
+SEXP term_stats_ndjson(SEXP sfile, SEXP sfield, SEXP sx, SEXP sngrams,
+		       SEXP smin_count, SEXP smax_count, SEXP smin_support,
+		       SEXP smax_support, SEXP soutput_types, SEXP sinteger)
+{
+	SEXP ans, sbuf, sctx, stext, sbatch;
+	struct context *ctx;
+	struct worker *w;
+	struct corpus_filebuf *buf;
+	struct corpus_filebuf_iter it;
+	struct corpus_filter *filter;
+	struct utf8lite_text name, text, *block;
+	const char *name_ptr;
+	R_xlen_t nrow;
+	int nblock, err = 0, nprot = 0;
+
+	if (!(isString(sfield) && LENGTH(sfield) == 1
+			&& STRING_ELT(sfield, 0) != NA_STRING)) {
+		error("invalid 'field' argument");
+	}
+
+	PROTECT(sbuf = alloc_filebuf(sfile)); nprot++;
+	buf = as_filebuf(sbuf);
+
+	// name must be in utf8 encoding (or 'native' on non-Windows)
+	name_ptr = translateCharUTF8(STRING_ELT(sfield, 0));
+	TRY(utf8lite_text_assign(&name, (const uint8_t *)name_ptr,
+				 strlen(name_ptr), 0, NULL));
+
+	PROTECT(stext = coerce_text(sx)); nprot++;
+	filter = text_filter(stext);
+
+	if (sngrams != R_NilValue) {
+		PROTECT(sngrams = coerceVector(sngrams, INTSXP)); nprot++;
+	}
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), context_destroy)); nprot++;
+        ctx = as_context(sctx);
+	context_init(ctx, sngrams, 1, LOGICAL(sinteger)[0] == TRUE);
+	context_start_workers(ctx, stext, filter);
+	w = &ctx->worker[0];
+
+	// with a vectorized R stemmer, collect the texts from a block of
+	// lines and stem their new types in one call before counting them
+	PROTECT(sbatch = alloc_stem_batch(stext)); nprot++;
+	block = (void *)R_alloc(STATS_NDJSON_BLOCK, sizeof(*block));
+	nblock = 0;
+
+	nrow = 0;
+	corpus_filebuf_iter_make(&it, buf);
+	while (corpus_filebuf_iter_advance(&it)) {
+		RCORPUS_CHECK_INTERRUPT(nrow);
+		nrow++;
+
+		// only the field gets parsed; missing, null, and non-text
+		// fields are like NA texts
+		err = json_field_text(it.current.ptr, it.current.size, &name,
+				      &text);
+		CHECK_ERROR_FORMAT(err, "failed parsing row %"PRIu64
+				   " of JSON data", (uint64_t)nrow);
+		if (!text.ptr) {
+			continue;
+		}
+
+		if (sbatch == R_NilValue) {
+			TRY(worker_add(w, &text));
+			continue;
+		}
+
+		block[nblock++] = text;
+		if (nblock == STATS_NDJSON_BLOCK) {
+			TRY(stats_ndjson_block(w, sbatch, block, nblock));
+			nblock = 0;
+		}
+	}
+
+	if (nblock > 0) {
+		TRY(stats_ndjson_block(w, sbatch, block, nblock));
+	}
+
+	PROTECT(ans = context_stats(ctx, &w->termset, filter->symtab.types,
+				    &w->table, smin_count, smax_count,
+				    smin_support, smax_support, soutput_types));
+	nprot++;
 out:
 	CHECK_ERROR(err);
         free_context(sctx);
@@ -314,3 +314,56 @@ SEXP items_termset(SEXP stermset)
 {
 	return R_ExternalPtrProtected(stermset);
 }
+
+
+/*
+ * Add the terms from another set to 'set', identifying types by their
+ * text. The source types get added to 'symtab' as needed; 'term_map'
+ * gets the IDs of the source terms in 'set'.
+ */
+int termset_merge(struct corpus_termset *set, struct corpus_symtab *symtab,
+		  const struct corpus_termset *src,
+		  const struct corpus_symtab *src_symtab, int *term_map)
+{
+	const struct corpus_termset_term *term;
+	int *buf, *buf2, *type_map;
+	int err = 0, i, j, nbuf, ntype, type_id;
+
+	buf = NULL;
+	nbuf = 0;
+	ntype = src_symtab->ntype;
+
+	TRY_ALLOC(type_map = corpus_malloc((ntype ? ntype : 1)
+					   * sizeof(*type_map)));
+	for (i = 0; i < ntype; i++) {
+		type_map[i] = -1;
+	}
+
+	for (i = 0; i < src->nitem; i++) {
+		term = &src->items[i];
+
+		if (term->length > nbuf) {
+			TRY_ALLOC(buf2 = corpus_realloc(buf, term->length
+							     * sizeof(*buf)));
+			buf = buf2;
+			nbuf = term->length;
+		}
+
+		for (j = 0; j < term->length; j++) {
+			type_id = term->type_ids[j];
+			if (type_map[type_id] < 0) {
+				TRY(corpus_symtab_add_type(symtab,
+					&src_symtab->types[type_id].text,
+					&type_map[type_id]));
+			}
+			buf[j] = type_map[type_id];
+		}
+
+		TRY(corpus_termset_add(set, buf, term->length,
+				       &term_map[i]));
+	}
+out:
+	corpus_free(buf);
+	corpus_free(type_map);
+	return err;
+}
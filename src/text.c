@@ -25,7 +25,8 @@
 enum source_type {
 	SOURCE_NONE = 0,
 	SOURCE_CHAR,
-	SOURCE_JSON
+	SOURCE_JSON,
+	SOURCE_FILE
 };
 
 
@@ -34,6 +35,7 @@ struct source {
 	union {
 		const struct json *set;
 		SEXP chars;
+		struct corpus_file file;
 	} data;
 	R_xlen_t nrow;
 };
@@ -41,7 +43,8 @@ struct source {
 
 static int is_source(SEXP x)
 {
-	return (x == R_NilValue || TYPEOF(x) == STRSXP || is_json(x));
+	return (x == R_NilValue || TYPEOF(x) == STRSXP || is_json(x)
+		|| is_filebuf(x));
 }
 
 
@@ -58,9 +61,16 @@ static void source_assign(struct source *source, SEXP value)
 		source->type = SOURCE_JSON;
 		source->data.set = as_json(value);
 		source->nrow = source->data.set->nrow;
+	} else if (is_filebuf(value)) {
+		source->type = SOURCE_FILE;
+		if (corpus_file_init(&source->data.file, as_filebuf(value))) {
+			error("file '%s' is not a valid corpus file",
+			      as_filebuf(value)->file_name);
+		}
+		source->nrow = (R_xlen_t)source->data.file.nrow;
 	} else {
 		error("invalid text source;"
-		      " should be 'character', 'json', or NULL");
+		      " should be 'character', 'json', 'filebuf', or NULL");
 	}
 }
 
@@ -75,14 +85,6 @@ static void free_text(SEXP stext)
 			corpus_sentfilter_destroy(&obj->sentfilter);
 		}
 
-		if (obj->has_filter) {
-			corpus_filter_destroy(&obj->filter);
-		}
-
-		if (obj->has_stemmer) {
-			stemmer_destroy(&obj->stemmer);
-		}
-
 		corpus_free(obj->text);
 		corpus_free(obj);
 	}
@@ -92,13 +94,26 @@ static void free_text(SEXP stext)
 static void load_text(SEXP x);
 
 
-SEXP alloc_text_handle(void)
+SEXP alloc_text_handle(SEXP sshare)
 {
-	SEXP ans;
+	SEXP ans, sfilter;
+
+	// a handle derived from 'share' uses the same compiled filter;
+	// the filter handle stays alive as long as some text refers to it
+	if (sshare != R_NilValue) {
+		if (TYPEOF(sshare) != EXTPTRSXP
+				|| R_ExternalPtrTag(sshare) != TEXT_TAG) {
+			error("invalid 'share' argument");
+		}
+		sfilter = text_filter_handle(sshare);
+	} else {
+		sfilter = alloc_filter_handle();
+	}
+	PROTECT(sfilter);
 
-	PROTECT(ans = R_MakeExternalPtr(NULL, TEXT_TAG, R_NilValue));
+	PROTECT(ans = R_MakeExternalPtr(NULL, TEXT_TAG, sfilter));
 	R_RegisterCFinalizerEx(ans, free_text, TRUE);
-	UNPROTECT(1);
+	UNPROTECT(2);
 	return ans;
 }
 
@@ -110,7 +125,7 @@ SEXP alloc_text(SEXP sources, SEXP source, SEXP row, SEXP start, SEXP stop,
 	R_xlen_t n;
 	int s, nsrc;
 
-	PROTECT(handle = alloc_text_handle());
+	PROTECT(handle = alloc_text_handle(R_NilValue));
 
 	n = XLENGTH(source);
 
@@ -453,6 +468,33 @@ static void load_text(SEXP x)
 	}
 
 	stable = getListElement(x, "table");
+
+	// a text read from a corpus file, with all of its rows, points
+	// straight into the file, without reading the table
+	if (nsrc == 1 && sources[0].type == SOURCE_FILE
+			&& is_corpus_file_table(stable,
+						VECTOR_ELT(ssources, 0))) {
+		R_RegisterCFinalizerEx(shandle, free_text, TRUE);
+		TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+		R_SetExternalPtrAddr(shandle, obj);
+
+		nrow = sources[0].nrow;
+		if (nrow > 0) {
+			TRY_ALLOC(obj->text = corpus_calloc(nrow,
+							sizeof(*obj->text)));
+			obj->length = nrow;
+		}
+		for (i = 0; i < nrow; i++) {
+			RCORPUS_CHECK_INTERRUPT(i);
+			if (corpus_file_text(&sources[0].data.file, i,
+					     &obj->text[i])) {
+				error("file in source 1 is not a valid"
+				      " corpus file");
+			}
+		}
+		goto out;
+	}
+
 	ssource = getListElement(stable, "source");
 	srow = getListElement(stable, "row");
 	sstart = getListElement(stable, "start");
@@ -536,6 +578,15 @@ static void load_text(SEXP x)
 			flags = UTF8LITE_TEXT_UNESCAPE;
 			break;
 
+		case SOURCE_FILE:
+			// the texts were validated and unescaped when written
+			if (corpus_file_text(&sources[s].data.file, j, &txt)) {
+				error("file in source %d is not a valid"
+				      " corpus file", s + 1);
+			}
+			flags = 0;
+			break;
+
 		default:
 			txt.ptr = NULL;
 			txt.attr = 0;
@@ -549,6 +600,12 @@ static void load_text(SEXP x)
 			end = (int)UTF8LITE_TEXT_SIZE(&txt);
 		}
 
+		if (sources[s].type == SOURCE_FILE && begin == 0
+				&& (size_t)end == UTF8LITE_TEXT_SIZE(&txt)) {
+			obj->text[i] = txt;
+			continue;
+		}
+
 		// this could be made more efficient; add a
 		// 'can_break?' function to corpus/text.h
 		err = utf8lite_text_assign(&obj->text[i], txt.ptr + begin,
@@ -564,7 +621,22 @@ out:
 }
 
 
+/*
+ * Convert a text to a character vector. With ALTREP, the strings get
+ * created on demand, as R asks for them; see text_altrep.c.
+ */
 SEXP as_character_text(SEXP x)
+{
+#ifdef RCORPUS_ALTREP
+	return alloc_text_altrep(x);
+#else
+	return strings_text(x);
+#endif
+}
+
+
+/* Create all of the strings for a text, as an ordinary character vector */
+SEXP strings_text(SEXP x)
 {
 	SEXP ans, str, sources, table, source, row, start, stop, src;
 	struct utf8lite_text *text;
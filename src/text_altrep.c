@@ -0,0 +1,207 @@
+/*
+ * Copyright 2017 Patrick O. Perry.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rcorpus.h"
+
+#ifdef RCORPUS_ALTREP
+
+#include <R_ext/Altrep.h>
+
+/*
+ * A lazy character vector for a text object. The first data slot holds
+ * the text; the second is R_NilValue until R asks for a pointer to the
+ * data, at which point it holds all of the strings. Until then, the
+ * elements get decoded one at a time from the text spans.
+ */
+
+static R_altrep_class_t text_altrep_class;
+
+
+SEXP alloc_text_altrep(SEXP stext)
+{
+	if (!is_text(stext)) {
+		error("invalid 'text' object");
+	}
+	return R_new_altrep(text_altrep_class, stext, R_NilValue);
+}
+
+
+static SEXP text_altrep_strings(SEXP x)
+{
+	SEXP strings = R_altrep_data2(x);
+
+	if (strings == R_NilValue) {
+		PROTECT(strings = strings_text(R_altrep_data1(x)));
+		R_set_altrep_data2(x, strings);
+		UNPROTECT(1);
+	}
+
+	return strings;
+}
+
+
+static R_xlen_t text_altrep_length(SEXP x)
+{
+	SEXP strings = R_altrep_data2(x);
+	SEXP table;
+
+	if (strings != R_NilValue) {
+		return XLENGTH(strings);
+	}
+
+	// use the table, not the handle, so that this does not allocate
+	table = getListElement(R_altrep_data1(x), "table");
+	return XLENGTH(getListElement(table, "source"));
+}
+
+
+/*
+ * Get the source string for element 'i' if the element spans all of it,
+ * the same shortcut that strings_text takes; otherwise, get NULL.
+ */
+static SEXP text_altrep_source_elt(SEXP stext, R_xlen_t i)
+{
+	SEXP sources, table, src, str;
+	R_xlen_t r;
+	int s;
+
+	sources = getListElement(stext, "sources");
+	table = getListElement(stext, "table");
+
+	s = INTEGER_ELT(getListElement(table, "source"), i) - 1;
+	src = VECTOR_ELT(sources, s);
+	if (TYPEOF(src) != STRSXP) {
+		return NULL;
+	}
+
+	r = (R_xlen_t)(REAL_ELT(getListElement(table, "row"), i) - 1);
+	str = STRING_ELT(src, r);
+
+	if (str == NA_STRING) {
+		return str;
+	} else if (INTEGER_ELT(getListElement(table, "start"), i) == 1
+			&& (INTEGER_ELT(getListElement(table, "stop"), i)
+			    == LENGTH(str))) {
+		return str;
+	}
+	return NULL;
+}
+
+
+static SEXP text_altrep_elt(SEXP x, R_xlen_t i)
+{
+	SEXP ans, strings = R_altrep_data2(x);
+	const struct utf8lite_text *text;
+	struct mkchar mk;
+	const void *vmax;
+
+	if (strings != R_NilValue) {
+		return STRING_ELT(strings, i);
+	}
+
+	if ((ans = text_altrep_source_elt(R_altrep_data1(x), i))) {
+		return ans;
+	}
+
+	// free the decoding buffer before returning
+	vmax = vmaxget();
+	text = as_text(R_altrep_data1(x), NULL);
+	mkchar_init(&mk);
+	ans = mkchar_get(&mk, &text[i]);
+	vmaxset(vmax);
+
+	return ans;
+}
+
+
+static void text_altrep_set_elt(SEXP x, R_xlen_t i, SEXP value)
+{
+	SET_STRING_ELT(text_altrep_strings(x), i, value);
+}
+
+
+/*
+ * R changes the elements with SET_STRING_ELT, which goes to the Set_elt
+ * method and from there to the materialized strings, so the pointer
+ * only ever gets read.
+ */
+static void *text_altrep_dataptr(SEXP x, Rboolean writeable)
+{
+	(void)writeable;
+	return (void *)STRING_PTR_RO(text_altrep_strings(x));
+}
+
+
+static const void *text_altrep_dataptr_or_null(SEXP x)
+{
+	SEXP strings = R_altrep_data2(x);
+
+	if (strings == R_NilValue) {
+		return NULL;
+	}
+	return STRING_PTR_RO(strings);
+}
+
+
+// serialize the text, not the strings, so the result stays lazy
+static SEXP text_altrep_serialized_state(SEXP x)
+{
+	return R_altrep_data1(x);
+}
+
+
+static SEXP text_altrep_unserialize(SEXP class, SEXP state)
+{
+	(void)class;
+	return alloc_text_altrep(state);
+}
+
+
+static Rboolean text_altrep_inspect(SEXP x, int pre, int deep, int pvec,
+				    void (*inspect_subtree)(SEXP, int, int,
+							    int))
+{
+	(void)pre;
+	(void)deep;
+	(void)pvec;
+	(void)inspect_subtree;
+
+	Rprintf("corpus_text strings (len=%.0f, %s)\n",
+		(double)text_altrep_length(x),
+		(R_altrep_data2(x) == R_NilValue) ? "lazy" : "materialized");
+	return TRUE;
+}
+
+
+void init_text_altrep(DllInfo *dll)
+{
+	R_altrep_class_t cls;
+
+	cls = R_make_altstring_class("corpus_text_strings", "corpus", dll);
+	text_altrep_class = cls;
+
+	R_set_altrep_Length_method(cls, text_altrep_length);
+	R_set_altrep_Serialized_state_method(cls,
+					     text_altrep_serialized_state);
+	R_set_altrep_Unserialize_method(cls, text_altrep_unserialize);
+	R_set_altrep_Inspect_method(cls, text_altrep_inspect);
+	R_set_altvec_Dataptr_method(cls, text_altrep_dataptr);
+	R_set_altvec_Dataptr_or_null_method(cls, text_altrep_dataptr_or_null);
+	R_set_altstring_Elt_method(cls, text_altrep_elt);
+	R_set_altstring_Set_elt_method(cls, text_altrep_set_elt);
+}
+
+#endif /* RCORPUS_ALTREP */
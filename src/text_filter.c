@@ -16,6 +16,8 @@
 
 #include "rcorpus.h"
 
+#define FILTER_TAG install("corpus::filter")
+
 
 static int filter_logical(SEXP filter, const char *key, int nullval)
 {
@@ -201,16 +203,161 @@ static int add_combine(void *obj, const struct utf8lite_text *x)
 }
 
 
-struct corpus_filter *text_filter(SEXP x)
+static SEXP filter_stemmer_dict(SEXP stemmer)
 {
-	SEXP handle, filter, combine, stemmer;
-	struct rcorpus_text *obj;
+	return getAttrib(stemmer, install("dictionary"));
+}
+
+
+static void stemmer_init_filter(struct stemmer *s, SEXP filter)
+{
+	SEXP stemmer;
 	const char *snowball;
+
+	stemmer = getListElement(filter, "stemmer");
+
+	if (stemmer == R_NilValue) {
+		stemmer_init_none(s);
+	} else if (TYPEOF(stemmer) == STRSXP) {
+		snowball = filter_stemmer_snowball(stemmer);
+		stemmer_init_snowball(s, snowball);
+	} else if (isFunction(stemmer)
+			&& is_stem_dict(filter_stemmer_dict(stemmer))) {
+		// functions from 'new_stemmer' stem without calling R
+		stemmer_init_dict(s, filter_stemmer_dict(stemmer));
+	} else if (isFunction(stemmer)) {
+		stemmer_init_rfunc(s, stemmer, R_GlobalEnv);
+	} else {
+		error("invalid filter 'stemmer' value");
+	}
+}
+
+
+static void filter_init(struct corpus_filter *f, int *has_filterptr,
+			const struct stemmer *s, SEXP filter)
+{
+	SEXP combine;
 	int32_t connector;
-	int err = 0, nprot = 0, type_kind, flags, stem_dropped;
+	int err = 0, type_kind, flags, stem_dropped;
+
+	type_kind = filter_type_kind(filter);
+	combine = getListElement(filter, "combine");
+	connector = filter_connector(filter);
+	flags = filter_flags(filter);
+	stem_dropped = filter_logical(filter, "stem_dropped", 0);
+
+	TRY(corpus_filter_init(f, flags, type_kind, connector, s->stem_func,
+			       s->stem_context));
+	*has_filterptr = 1;
+
+	if (!stem_dropped) {
+		add_terms(add_stem_except, f, getListElement(filter, "drop"));
+	}
+	add_terms(add_stem_except, f, getListElement(filter, "stem_except"));
+	add_terms(add_drop, f, getListElement(filter, "drop"));
+	add_terms(add_drop_except, f, getListElement(filter, "drop_except"));
+	add_terms(add_combine, f, combine);
+out:
+	CHECK_ERROR(err);
+}
+
+
+static void filter_file_init_filter(struct filter_file *file,
+				    int *has_fileptr, SEXP filter)
+{
+	SEXP name = getListElement(filter, "cache");
+
+	if (name == R_NilValue) {
+		return;
+	}
+
+	filter_file_init(file, name);
+	*has_fileptr = 1;
+}
+
+
+static void filter_destroy(struct rcorpus_filter *obj)
+{
+	if (obj->has_filter) {
+		corpus_filter_destroy(&obj->filter);
+		obj->has_filter = 0;
+	}
+
+	if (obj->has_stemmer) {
+		stemmer_destroy(&obj->stemmer);
+		obj->has_stemmer = 0;
+	}
+
+	if (obj->has_file) {
+		filter_file_destroy(&obj->file);
+		obj->has_file = 0;
+	}
+}
+
+
+static void free_filter(SEXP sfilter)
+{
+	struct rcorpus_filter *obj = R_ExternalPtrAddr(sfilter);
+	R_SetExternalPtrAddr(sfilter, NULL);
+
+	if (obj) {
+		filter_destroy(obj);
+		corpus_free(obj);
+	}
+}
+
+
+SEXP alloc_filter_handle(void)
+{
+	// the finalizer gets registered when the filter gets allocated
+	return R_MakeExternalPtr(NULL, FILTER_TAG, R_NilValue);
+}
+
+
+/*
+ * Get the compiled filter handle for a text handle. Handles from before
+ * filters were shared do not have one, so allocate it on first use.
+ */
+SEXP text_filter_handle(SEXP handle)
+{
+	SEXP sfilter = R_ExternalPtrProtected(handle);
+
+	if (TYPEOF(sfilter) != EXTPTRSXP
+			|| R_ExternalPtrTag(sfilter) != FILTER_TAG) {
+		PROTECT(sfilter = alloc_filter_handle());
+		R_SetExternalPtrProtected(handle, sfilter);
+		UNPROTECT(1);
+	}
+
+	return sfilter;
+}
+
+
+static struct rcorpus_filter *as_filter_handle(SEXP sfilter)
+{
+	struct rcorpus_filter *obj = R_ExternalPtrAddr(sfilter);
+	int err = 0;
+
+	// the address is NULL for a new handle or after deserializing;
+	// either way, the handle has no finalizer yet
+	if (!obj) {
+		R_RegisterCFinalizerEx(sfilter, free_filter, TRUE);
+		TRY_ALLOC(obj = corpus_calloc(1, sizeof(*obj)));
+		R_SetExternalPtrAddr(sfilter, obj);
+	}
+out:
+	CHECK_ERROR(err);
+	return obj;
+}
+
+
+static struct rcorpus_filter *text_filter_compile(SEXP x)
+{
+	SEXP handle, filter;
+	struct rcorpus_filter *obj;
 
 	handle = getListElement(x, "handle");
-	obj = R_ExternalPtrAddr(handle);
+	obj = as_filter_handle(text_filter_handle(handle));
 
 	// check the stemmer for errors
 	if (obj->has_stemmer && obj->stemmer.error) {
@@ -219,7 +366,7 @@ struct corpus_filter *text_filter(SEXP x)
 
 	if (obj->has_filter) {
 		if (obj->valid_filter && !obj->filter.error) {
-			return &obj->filter;
+			return obj;
 		} else {
 			corpus_filter_destroy(&obj->filter);
 			obj->has_filter = 0;
@@ -232,59 +379,212 @@ struct corpus_filter *text_filter(SEXP x)
 	obj->valid_filter = 0;
 
 	filter = getListElement(x, "filter");
-	type_kind = filter_type_kind(filter);
-	combine = getListElement(filter, "combine");
-	connector = filter_connector(filter);
-	flags = filter_flags(filter);
-	stem_dropped = filter_logical(filter, "stem_dropped", 0);
 
 	if (obj->has_stemmer && obj->stemmer.error) {
 		stemmer_destroy(&obj->stemmer);
 		obj->has_stemmer = 0;
 	}
 
+	if (!obj->has_file) {
+		filter_file_init_filter(&obj->file, &obj->has_file, filter);
+	}
+
 	if (!obj->has_stemmer) {
-		stemmer = getListElement(filter, "stemmer");
-		
-		if (stemmer == R_NilValue) {
-			stemmer_init_none(&obj->stemmer);
-		} else if (TYPEOF(stemmer) == STRSXP) {
-			snowball = filter_stemmer_snowball(stemmer);
-			stemmer_init_snowball(&obj->stemmer, snowball);
-		} else if (isFunction(stemmer)) {
-			stemmer_init_rfunc(&obj->stemmer, stemmer,
-					   R_GlobalEnv);
-		} else {
-			error("invalid filter 'stemmer' value");
+		stemmer_init_filter(&obj->stemmer, filter);
+		obj->has_stemmer = 1;
+		obj->stemmer_gen++;
+		stemmer_keep_stems(&obj->stemmer);
+
+		if (obj->has_file) {
+			filter_file_load_stems(&obj->file, &obj->stemmer,
+					       filter);
 		}
+	}
 
-		obj->has_stemmer = 1;
+	filter_init(&obj->filter, &obj->has_filter, &obj->stemmer, filter);
+	if (obj->has_file) {
+		filter_file_load_types(&obj->file, &obj->filter);
 	}
 
-	TRY(corpus_filter_init(&obj->filter, flags, type_kind,
-			       connector, obj->stemmer.stem_func,
-			       obj->stemmer.stem_context));
-	obj->has_filter = 1;
+	obj->valid_filter = 1;
+	return obj;
+}
 
-	if (!stem_dropped) {
-		add_terms(add_stem_except, &obj->filter,
-			  getListElement(filter, "drop"));
-	}
-	add_terms(add_stem_except, &obj->filter,
-		  getListElement(filter, "stem_except"));
-add_terms(add_drop, &obj->filter,
-		  getListElement(filter, "drop"));
-	add_terms(add_drop_except, &obj->filter,
-		  getListElement(filter, "drop_except"));
-	add_terms(add_combine, &obj->filter, combine);
+
+struct stem_batch {
+	struct corpus_filter filter;
+	struct stemmer none;
+	struct stemmer *stemmer;
+	int ntype;
+	int has_filter;
+};
+
+
+static void stem_batch_destroy(void *obj)
+{
+	struct stem_batch *batch = obj;
+
+	if (batch->has_filter) {
+		corpus_filter_destroy(&batch->filter);
+	}
+}
+
+
+/*
+ * A stem batch stems the types of a group of texts with one call to a
+ * vectorized R stemmer, instead of one call per type. A filter without a
+ * stemmer finds the types; the ones it hasn't seen before go to the
+ * stemmer in a single batch, and the results fill the stem cache, so that
+ * the real filter never has to call into R. The result is R_NilValue if
+ * the text's stemmer doesn't take batches.
+ */
+SEXP alloc_stem_batch(SEXP x)
+{
+	SEXP sbatch;
+	struct rcorpus_filter *obj = text_filter_compile(x);
+	struct stem_batch *batch;
+
+	if (!stemmer_batched(&obj->stemmer)) {
+		return R_NilValue;
+	}
+
+	PROTECT(sbatch = alloc_context(sizeof(*batch), stem_batch_destroy));
+	batch = as_context(sbatch);
+	batch->stemmer = &obj->stemmer;
+
+	stemmer_init_none(&batch->none);
+	filter_init(&batch->filter, &batch->has_filter, &batch->none,
+		    getListElement(x, "filter"));
+
+	UNPROTECT(1);
+	return sbatch;
+}
+
+
+void stem_batch_add(SEXP sbatch, const struct utf8lite_text *text,
+		    R_xlen_t n)
+{
+	struct stem_batch *batch = as_context(sbatch);
+	const struct corpus_symtab *symtab = &batch->filter.symtab;
+	R_xlen_t i;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		TRY(corpus_filter_start(&batch->filter, &text[i]));
+		while (corpus_filter_advance(&batch->filter)) {
+			// the types go in the symbol table
+		}
+		TRY(batch->filter.error);
+	}
+
+	// the symbol table only grows, so the new types are at the end
+	stemmer_batch(batch->stemmer, symtab->types + batch->ntype,
+		      symtab->ntype - batch->ntype);
+	batch->ntype = symtab->ntype;
 out:
-	UNPROTECT(nprot);
 	CHECK_ERROR(err);
-	obj->valid_filter = 1;
+}
+
+
+/*
+ * Batch the types of each text handle once per compiled stemmer. The
+ * texts sharing a compiled filter can have disjoint vocabularies, so the
+ * batch runs for every handle; the stemmer skips the types it has
+ * already cached.
+ */
+static void text_filter_batch(struct rcorpus_filter *obj, SEXP x)
+{
+	SEXP sbatch;
+	struct rcorpus_text *handle;
+	const struct utf8lite_text *text;
+	R_xlen_t n;
+
+	if (!stemmer_batched(&obj->stemmer)) {
+		return;
+	}
+
+	text = as_text(x, &n);
+	handle = R_ExternalPtrAddr(getListElement(x, "handle"));
+	if (handle->batched_gen == obj->stemmer_gen) {
+		return;
+	}
+
+	PROTECT(sbatch = alloc_stem_batch(x));
+	stem_batch_add(sbatch, text, n);
+	free_context(sbatch);
+	UNPROTECT(1);
+
+	handle->batched_gen = obj->stemmer_gen;
+}
+
+
+struct corpus_filter *text_filter(SEXP x)
+{
+	struct rcorpus_filter *obj = text_filter_compile(x);
+
+	text_filter_batch(obj, x);
 	return &obj->filter;
 }
 
 
+struct stemmer *text_stemmer(SEXP x)
+{
+	return &text_filter_compile(x)->stemmer;
+}
+
+
+int text_filter_threadsafe(SEXP x)
+{
+	SEXP filter, stemmer;
+
+	// R stemming functions can only get called from the main thread
+	filter = getListElement(x, "filter");
+	stemmer = getListElement(filter, "stemmer");
+	return (!isFunction(stemmer)
+		|| is_stem_dict(filter_stemmer_dict(stemmer)));
+}
+
+
+void text_filter_copy_init(struct text_filter_copy *copy, SEXP x)
+{
+	SEXP filter = getListElement(x, "filter");
+
+	filter_file_init_filter(&copy->file, &copy->has_file, filter);
+
+	stemmer_init_filter(&copy->stemmer, filter);
+	copy->has_stemmer = 1;
+
+	if (copy->has_file) {
+		filter_file_load_stems(&copy->file, &copy->stemmer, filter);
+	}
+
+	filter_init(&copy->filter, &copy->has_filter, &copy->stemmer, filter);
+	if (copy->has_file) {
+		filter_file_load_types(&copy->file, &copy->filter);
+	}
+}
+
+
+void text_filter_copy_destroy(struct text_filter_copy *copy)
+{
+	if (copy->has_filter) {
+		corpus_filter_destroy(&copy->filter);
+		copy->has_filter = 0;
+	}
+
+	if (copy->has_stemmer) {
+		stemmer_destroy(&copy->stemmer);
+		copy->has_stemmer = 0;
+	}
+	if (copy->has_file) {
+		filter_file_destroy(&copy->file);
+		copy->has_file = 0;
+	}
+}
+
+
 static int sentfilter_flags(SEXP filter)
 {
 	int flags = CORPUS_SENTSCAN_SPCRLF;
@@ -42,9 +42,21 @@ SEXP filter_text(SEXP text)
 
 SEXP length_text(SEXP stext)
 {
-	R_xlen_t len;
-	as_text(stext, &len);
-	return ScalarReal((double)len);
+	SEXP handle, table;
+	const struct rcorpus_text *obj;
+
+	if (!is_text(stext)) {
+		error("invalid text object");
+	}
+
+	handle = getListElement(stext, "handle");
+	if ((obj = R_ExternalPtrAddr(handle))) {
+		return ScalarReal((double)obj->length);
+	}
+
+	// use the table, so that this does not load the text
+	table = getListElement(stext, "table");
+	return ScalarReal((double)XLENGTH(getListElement(table, "source")));
 }
 
 
@@ -17,6 +17,7 @@
 #include <math.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rcorpus.h"
 
 
@@ -110,13 +111,18 @@ static void context_trim(struct context *ctx)
 }
 
 
-static SEXP context_make(struct context *ctx, SEXP sx)
+/*
+ * Make the split result: a data frame with the parent and index of each
+ * block, or, with 'ragged', the blocks along with n + 1 offsets giving
+ * the range of blocks for each parent text.
+ */
+static SEXP context_make(struct context *ctx, SEXP sx, int ragged)
 {
 	SEXP ans, handle, sources, psource, prow, pstart, ptable, source,
-	     row, start, stop, index, sparent, stext, names, filter,
+	     row, start, stop, index, sparent, soffsets, stext, names, filter,
 	     sclass, row_names;
 	struct rcorpus_text *obj;
-	R_xlen_t src, i, iblock, nblock;
+	R_xlen_t src, i, iblock, nblock, n;
 	double r;
 	int err = 0, j, off, len, nprot;
 
@@ -131,13 +137,22 @@ static SEXP context_make(struct context *ctx, SEXP sx)
 	psource = getListElement(ptable, "source");
 	prow = getListElement(ptable, "row");
 	pstart = getListElement(ptable, "start");
+	n = XLENGTH(psource);
 
 	PROTECT(source = allocVector(INTSXP, nblock)); nprot++;
 	PROTECT(row = allocVector(REALSXP, nblock)); nprot++;
 	PROTECT(start = allocVector(INTSXP, nblock)); nprot++;
 	PROTECT(stop = allocVector(INTSXP, nblock)); nprot++;
-	PROTECT(sparent = allocVector(REALSXP, nblock)); nprot++;
-	PROTECT(index = allocVector(INTSXP, nblock)); nprot++;
+	if (ragged) {
+		PROTECT(soffsets = allocVector(REALSXP, n + 1)); nprot++;
+		memset(REAL(soffsets), 0, (size_t)(n + 1) * sizeof(double));
+		sparent = R_NilValue;
+		index = R_NilValue;
+	} else {
+		PROTECT(sparent = allocVector(REALSXP, nblock)); nprot++;
+		PROTECT(index = allocVector(INTSXP, nblock)); nprot++;
+		soffsets = R_NilValue;
+	}
 
 	i = -1;
 	j = 0;
@@ -161,8 +176,13 @@ static SEXP context_make(struct context *ctx, SEXP sx)
 		REAL(row)[iblock] = r;
 		INTEGER(start)[iblock] = off;
 		INTEGER(stop)[iblock] = off + (len - 1);
-		INTEGER(index)[iblock] = j + 1;
-		REAL(sparent)[iblock] = (double)i + 1;
+
+		if (ragged) {
+			REAL(soffsets)[i + 1] = (double)iblock + 1;
+		} else {
+			INTEGER(index)[iblock] = j + 1;
+			REAL(sparent)[iblock] = (double)i + 1;
+		}
 
 		j++;
 		off += len;
@@ -184,6 +204,18 @@ static SEXP context_make(struct context *ctx, SEXP sx)
 	obj->length = nblock;
 	ctx->block = NULL;
 
+	if (ragged) {
+		// parents without blocks end where the previous one does
+		for (i = 0; i < n; i++) {
+			if (REAL(soffsets)[i + 1] < REAL(soffsets)[i]) {
+				REAL(soffsets)[i + 1] = REAL(soffsets)[i];
+			}
+		}
+		PROTECT(ans = make_ragged(stext, soffsets, names_text(sx)));
+		nprot++;
+		goto out;
+	}
+
 	PROTECT(ans = allocVector(VECSXP, 3)); nprot++;
 	SET_VECTOR_ELT(ans, 0, sparent);
 	SET_VECTOR_ELT(ans, 1, index);
@@ -212,7 +244,7 @@ out:
 }
 
 
-SEXP text_split_sentences(SEXP sx, SEXP ssize)
+SEXP text_split_sentences(SEXP sx, SEXP ssize, SEXP sragged)
 {
 	SEXP ans, sctx, snsent;
 	struct context *ctx;
@@ -312,7 +344,8 @@ SEXP text_split_sentences(SEXP sx, SEXP ssize)
 		}
 	}
 
-	PROTECT(ans = context_make(ctx, sx)); nprot++;
+	PROTECT(ans = context_make(ctx, sx, LOGICAL(sragged)[0] == TRUE));
+	nprot++;
 out:
         free_context(sctx);
 	CHECK_ERROR(err);
@@ -321,7 +354,7 @@ out:
 }
 
 
-SEXP text_split_tokens(SEXP sx, SEXP ssize)
+SEXP text_split_tokens(SEXP sx, SEXP ssize, SEXP sragged)
 {
 	SEXP ans, sctx, sntok;
 	struct context *ctx;
@@ -429,7 +462,8 @@ SEXP text_split_tokens(SEXP sx, SEXP ssize)
 		}
 	}
 
-	PROTECT(ans = context_make(ctx, sx)); nprot++;
+	PROTECT(ans = context_make(ctx, sx, LOGICAL(sragged)[0] == TRUE));
+	nprot++;
 out:
 	free_context(sctx);
 	CHECK_ERROR(err);
@@ -203,3 +203,302 @@ SEXP text_tokens(SEXP sx)
 	UNPROTECT(nprot);
 	return ans;
 }
+
+
+/*
+ * A local vocabulary numbers the filter types that appear in the texts,
+ * in order of first appearance, so that the type table only has the
+ * types that got used, even when the filter is shared with other texts.
+ */
+struct vocab {
+	const struct corpus_filter *filter;
+	int *local;	// local ID + 1 for each filter type, or 0 if unused
+	int *type;	// filter type for each local ID
+	int ntype;
+};
+
+
+static void vocab_init(struct vocab *v, const struct corpus_filter *filter)
+{
+	int ntype = filter->symtab.ntype;
+
+	v->filter = filter;
+	v->local = (void *)R_alloc(ntype, sizeof(*v->local));
+	v->type = (void *)R_alloc(ntype, sizeof(*v->type));
+	v->ntype = 0;
+	if (ntype > 0) {
+		memset(v->local, 0, ntype * sizeof(*v->local));
+	}
+}
+
+
+// the local ID (1-based) of a filter type, adding it if new
+static int vocab_id(struct vocab *v, int type_id)
+{
+	if (!v->local[type_id]) {
+		v->type[v->ntype++] = type_id;
+		v->local[type_id] = v->ntype;
+	}
+	return v->local[type_id];
+}
+
+
+// the local type table, as a character vector
+static SEXP vocab_types(const struct vocab *v)
+{
+	SEXP ans;
+	const struct utf8lite_text *type;
+	int id;
+
+	PROTECT(ans = allocVector(STRSXP, v->ntype));
+	for (id = 0; id < v->ntype; id++) {
+		RCORPUS_CHECK_INTERRUPT(id);
+		type = &v->filter->symtab.types[v->type[id]].text;
+		SET_STRING_ELT(ans, id,
+			       mkCharLenCE((char *)type->ptr,
+					   UTF8LITE_TEXT_SIZE(type), CE_UTF8));
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+static SEXP tokens_make_ids(SEXP sids, SEXP stypes)
+{
+	SEXP ans, names;
+
+	PROTECT(ans = allocVector(VECSXP, 2));
+	SET_VECTOR_ELT(ans, 0, sids);
+	SET_VECTOR_ELT(ans, 1, stypes);
+
+	PROTECT(names = allocVector(STRSXP, 2));
+	SET_STRING_ELT(names, 0, mkChar("ids"));
+	SET_STRING_ELT(names, 1, mkChar("types"));
+	setAttrib(ans, R_NamesSymbol, names);
+
+	UNPROTECT(2);
+	return ans;
+}
+
+
+/*
+ * Tokenize the texts into vectors of type IDs rather than into character
+ * vectors. The type strings only get created once, at the end, so the
+ * cost per token is an integer. The IDs index a local vocabulary with
+ * only the types in the texts, numbered in order of first appearance.
+ */
+SEXP text_token_ids(SEXP sx)
+{
+	SEXP ans, ids, names, sids, stypes;
+	const struct utf8lite_text *text;
+	struct corpus_filter *filter;
+	struct tokens ctx;
+	struct vocab vocab;
+	R_xlen_t i, n;
+	int *id;
+	int err = 0, nprot = 0, j, type_id;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+	filter = text_filter(sx);
+
+	PROTECT(sids = allocVector(VECSXP, n)); nprot++;
+	names = names_text(sx);
+	setAttrib(sids, R_NamesSymbol, names);
+
+	tokens_init(&ctx, filter);
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (!text[i].ptr) {
+			SET_VECTOR_ELT(sids, i, ScalarInteger(NA_INTEGER));
+			continue;
+		}
+
+		TRY(corpus_filter_start(filter, &text[i]));
+		while (corpus_filter_advance(filter)) {
+			type_id = filter->type_id;
+			if (type_id >= 0) {
+				tokens_add_token(&ctx, type_id);
+			}
+		}
+		TRY(filter->error);
+
+		ids = allocVector(INTSXP, ctx.ntoken);
+		SET_VECTOR_ELT(sids, i, ids);
+		id = INTEGER(ids);
+		for (j = 0; j < ctx.ntoken; j++) {
+			id[j] = ctx.tokens[j] + 1;
+		}
+		tokens_clear_tokens(&ctx);
+	}
+
+	// renumber the filter type IDs now that the filter has seen them all
+	vocab_init(&vocab, filter);
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+		ids = VECTOR_ELT(sids, i);
+		id = INTEGER(ids);
+		for (j = 0; j < XLENGTH(ids); j++) {
+			if (id[j] != NA_INTEGER) {
+				id[j] = vocab_id(&vocab, id[j] - 1);
+			}
+		}
+	}
+
+	PROTECT(stypes = vocab_types(&vocab)); nprot++;
+	PROTECT(ans = tokens_make_ids(sids, stypes)); nprot++;
+out:
+	UNPROTECT(nprot);
+	CHECK_ERROR(err);
+	return ans;
+}
+
+
+/*
+ * A ragged array packs a list of vectors into one flat vector of values
+ * and a vector of n + 1 offsets: the values for item i are at indices
+ * offsets[i], ..., offsets[i + 1] - 1. It avoids allocating an R object
+ * per item. A missing text gets a single NA value, as in the list form.
+ */
+struct ragged {
+	int *token;
+	R_xlen_t ntoken;
+	size_t ntoken_max;
+};
+
+
+static void ragged_destroy(void *obj)
+{
+	struct ragged *ctx = obj;
+	corpus_free(ctx->token);
+}
+
+
+static void ragged_add(struct ragged *ctx, int type_id)
+{
+	void *base;
+	size_t size;
+	int err = 0;
+
+	if ((size_t)ctx->ntoken == ctx->ntoken_max) {
+		size = ctx->ntoken_max;
+		TRY(corpus_bigarray_size_add(&size, sizeof(*ctx->token),
+					     (size_t)ctx->ntoken, 1));
+		TRY_ALLOC(base = corpus_realloc(ctx->token,
+						size * sizeof(*ctx->token)));
+		ctx->token = base;
+		ctx->ntoken_max = size;
+	}
+
+	ctx->token[ctx->ntoken++] = type_id;
+out:
+	CHECK_ERROR(err);
+}
+
+
+SEXP make_ragged(SEXP values, SEXP offsets, SEXP names)
+{
+	SEXP ans, snames;
+
+	PROTECT(ans = allocVector(VECSXP, 3));
+	SET_VECTOR_ELT(ans, 0, values);
+	SET_VECTOR_ELT(ans, 1, offsets);
+	SET_VECTOR_ELT(ans, 2, names);
+
+	PROTECT(snames = allocVector(STRSXP, 3));
+	SET_STRING_ELT(snames, 0, mkChar("values"));
+	SET_STRING_ELT(snames, 1, mkChar("offsets"));
+	SET_STRING_ELT(snames, 2, mkChar("names"));
+	setAttrib(ans, R_NamesSymbol, snames);
+
+	UNPROTECT(2);
+	return ans;
+}
+
+
+SEXP text_tokens_ragged(SEXP sx, SEXP sids)
+{
+	SEXP ans, sctx, soffsets, stypes, svalues;
+	const struct utf8lite_text *text;
+	struct corpus_filter *filter;
+	struct ragged *ctx;
+	struct vocab vocab;
+	double *offsets;
+	R_xlen_t i, k, n;
+	int err = 0, ids, nprot = 0, type_id;
+
+	PROTECT(sx = coerce_text(sx)); nprot++;
+	text = as_text(sx, &n);
+	filter = text_filter(sx);
+	ids = (LOGICAL(sids)[0] == TRUE);
+
+	PROTECT(sctx = alloc_context(sizeof(*ctx), ragged_destroy)); nprot++;
+	ctx = as_context(sctx);
+
+	PROTECT(soffsets = allocVector(REALSXP, n + 1)); nprot++;
+	offsets = REAL(soffsets);
+	offsets[0] = 0;
+
+	for (i = 0; i < n; i++) {
+		RCORPUS_CHECK_INTERRUPT(i);
+
+		if (!text[i].ptr) {
+			ragged_add(ctx, -1);
+			offsets[i + 1] = (double)ctx->ntoken;
+			continue;
+		}
+
+		TRY(corpus_filter_start(filter, &text[i]));
+		while (corpus_filter_advance(filter)) {
+			type_id = filter->type_id;
+			if (type_id >= 0) {
+				ragged_add(ctx, type_id);
+			}
+		}
+		TRY(filter->error);
+
+		offsets[i + 1] = (double)ctx->ntoken;
+	}
+
+	// replace the filter type IDs by local IDs (1-based)
+	vocab_init(&vocab, filter);
+	for (k = 0; k < ctx->ntoken; k++) {
+		RCORPUS_CHECK_INTERRUPT(k);
+		type_id = ctx->token[k];
+		if (type_id >= 0) {
+			ctx->token[k] = vocab_id(&vocab, type_id);
+		}
+	}
+
+	PROTECT(stypes = vocab_types(&vocab)); nprot++;
+
+	if (ids) {
+		PROTECT(svalues = allocVector(INTSXP, ctx->ntoken)); nprot++;
+		for (k = 0; k < ctx->ntoken; k++) {
+			RCORPUS_CHECK_INTERRUPT(k);
+			type_id = ctx->token[k];
+			INTEGER(svalues)[k] = (type_id < 0 ? NA_INTEGER
+					       : type_id);
+		}
+	} else {
+		PROTECT(svalues = allocVector(STRSXP, ctx->ntoken)); nprot++;
+		for (k = 0; k < ctx->ntoken; k++) {
+			RCORPUS_CHECK_INTERRUPT(k);
+			type_id = ctx->token[k];
+			SET_STRING_ELT(svalues, k, (type_id < 0 ? NA_STRING
+					: STRING_ELT(stypes, type_id - 1)));
+		}
+	}
+
+	PROTECT(ans = make_ragged(svalues, soffsets, names_text(sx))); nprot++;
+	if (ids) {
+		PROTECT(ans = tokens_make_ids(ans, stypes)); nprot++;
+	}
+out:
+	CHECK_ERROR(err);
+	free_context(sctx);
+	UNPROTECT(nprot);
+	return ans;
+}
@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <Rdefines.h>
 #include "rcorpus.h"
@@ -78,3 +80,63 @@ double *as_weights(SEXP sweights, R_xlen_t n)
 
 	return REAL(sweights);
 }
+
+
+int thread_count(SEXP sthreads, R_xlen_t nitem)
+{
+	int nthread = 1;
+
+#ifdef _OPENMP
+	if (sthreads != R_NilValue && INTEGER(sthreads)[0] > 1) {
+		nthread = INTEGER(sthreads)[0];
+	}
+#else
+	(void)sthreads;
+#endif
+
+	// no point in having more threads than work items
+	if ((R_xlen_t)nthread > nitem) {
+		nthread = nitem > 0 ? (int)nitem : 1;
+	}
+
+	return nthread;
+}
+
+
+const char *file_path(SEXP sfile)
+{
+	const char *path;
+	char *copy;
+
+	// R_ExpandFileName uses a static buffer, so make a copy
+	path = R_ExpandFileName(translateChar(STRING_ELT(sfile, 0)));
+	copy = R_alloc(strlen(path) + 1, 1);
+	strcpy(copy, path);
+	return copy;
+}
+
+
+FILE *open_file(const char *name)
+{
+	FILE *file;
+
+	errno = 0;
+	if (!(file = fopen(name, "wb"))) {
+		if (errno) {
+			error("cannot open file '%s': %s", name,
+			      strerror(errno));
+		} else {
+			error("cannot open file '%s'", name);
+		}
+	}
+	return file;
+}
+
+
+void write_file(FILE *file, const char *name, const void *ptr, size_t size,
+		size_t count)
+{
+	if (count > 0 && fwrite(ptr, size, count, file) != count) {
+		error("failed writing to file '%s'", name);
+	}
+}